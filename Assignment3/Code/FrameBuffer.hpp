@@ -0,0 +1,179 @@
+//
+// Color buffer of the rasterizer
+//
+
+#pragma once
+
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace rst
+{
+    // How a pixel is stored. Colors go in and come out as 0-255 floats, what the shaders return.
+    enum class Format
+    {
+        RGBA8,     // 4 bytes, rounded to whole values like the image written out
+        RGBA16F,   // 8 bytes, half floats
+        RGB32F     // 12 bytes, exact
+    };
+
+    // Pixels are stored tile by tile: a tile_size x tile_size tile is contiguous in memory, and tiles
+    // are the same as the rasterizer's, so a thread drawing a tile writes one block of memory that no
+    // other thread touches. x and y count from the bottom left pixel, (0, 0).
+    class FrameBuffer
+    {
+    public:
+        static constexpr int tile_size = 32;
+
+        // Row-major image, top row first: 4 bytes per pixel in the order B, G, R, A that OpenCV
+        // expects, stride bytes from one row to the next.
+        // cv::Mat(height, width, CV_8UC4, data, stride) wraps it without a copy.
+        struct View
+        {
+            uint8_t* data;
+            int width, height;
+            size_t stride;
+        };
+
+        FrameBuffer(int w, int h, Format f = Format::RGBA8)
+            : width(w), height(h), tiles_x((w + tile_size - 1) / tile_size), format(f)
+        {
+            pixel_size = format == Format::RGBA8 ? 4 : format == Format::RGBA16F ? 8 : 12;
+            int tiles_y = (h + tile_size - 1) / tile_size;
+            storage.resize((size_t)tiles_x * tiles_y * tile_size * tile_size * pixel_size);
+        }
+
+        Format get_format() const { return format; }
+
+        void set(int x, int y, const Eigen::Vector3f& color)
+        {
+            uint8_t* p = &storage[offset(x, y)];
+            switch (format)
+            {
+                case Format::RGBA8:
+                {
+                    uint32_t packed = to_byte(color.x()) | to_byte(color.y()) << 8 | to_byte(color.z()) << 16 | 0xffu << 24;
+                    std::memcpy(p, &packed, 4);
+                    break;
+                }
+                case Format::RGBA16F:
+                {
+                    uint16_t half[4] = {to_half(color.x()), to_half(color.y()), to_half(color.z()), to_half(1.0f)};
+                    std::memcpy(p, half, 8);
+                    break;
+                }
+                case Format::RGB32F:
+                    std::memcpy(p, color.data(), 12);
+                    break;
+            }
+        }
+
+        Eigen::Vector3f get(int x, int y) const
+        {
+            const uint8_t* p = &storage[offset(x, y)];
+            switch (format)
+            {
+                case Format::RGBA8:
+                    return Eigen::Vector3f(p[0], p[1], p[2]);
+                case Format::RGBA16F:
+                {
+                    uint16_t half[4];
+                    std::memcpy(half, p, 8);
+                    return Eigen::Vector3f(from_half(half[0]), from_half(half[1]), from_half(half[2]));
+                }
+                default:
+                {
+                    Eigen::Vector3f color;
+                    std::memcpy(color.data(), p, 12);
+                    return color;
+                }
+            }
+        }
+
+        void clear(const Eigen::Vector3f& color)
+        {
+            set(0, 0, color);
+            for (size_t i = pixel_size; i < storage.size(); i += pixel_size)
+                std::memcpy(&storage[i], &storage[0], pixel_size);
+        }
+
+        // The frame as a row-major 8 bit image, converted in one pass into a buffer the frame buffer
+        // keeps (valid until the next call)
+        View bgra8()
+        {
+            image.resize((size_t)width * height);
+            for (int row = 0; row < height; ++row)
+            {
+                int y = height - 1 - row;
+                uint32_t* out = &image[(size_t)row * width];
+                for (int x = 0; x < width; ++x)
+                {
+                    if (format == Format::RGBA8)
+                    {
+                        // swap R and B, the rest stays
+                        uint32_t c;
+                        std::memcpy(&c, &storage[offset(x, y)], 4);
+                        out[x] = (c & 0xff00ff00u) | (c & 0xffu) << 16 | (c >> 16 & 0xffu);
+                    }
+                    else
+                    {
+                        Eigen::Vector3f color = get(x, y);
+                        out[x] = to_byte(color.z()) | to_byte(color.y()) << 8 | to_byte(color.x()) << 16 | 0xffu << 24;
+                    }
+                }
+            }
+            return {(uint8_t*)image.data(), width, height, (size_t)width * 4};
+        }
+
+    private:
+        int width, height, tiles_x;
+        Format format;
+        int pixel_size;
+        std::vector<uint8_t> storage;
+        std::vector<uint32_t> image;
+
+        size_t offset(int x, int y) const
+        {
+            int tile = (y / tile_size) * tiles_x + x / tile_size;
+            return ((size_t)tile * tile_size * tile_size + (y % tile_size) * tile_size + x % tile_size) * pixel_size;
+        }
+
+        static uint32_t to_byte(float v)
+        {
+            return (uint32_t)std::clamp((int)std::lround(v), 0, 255);
+        }
+
+        // float <-> IEEE half, round to nearest; colors are never NaN
+        static uint16_t to_half(float v)
+        {
+            uint32_t f;
+            std::memcpy(&f, &v, 4);
+            uint16_t sign = f >> 16 & 0x8000;
+            float a = std::fabs(v);
+            if (a >= 65520.0f)
+                return sign | 0x7c00;
+            if (a < 6.103515625e-05f)   // subnormal half, steps of 2^-24
+                return sign | (uint16_t)std::lround(a * 16777216.0f);
+            std::memcpy(&f, &a, 4);
+            // keep 10 of the 23 mantissa bits, rounding; a carry into the exponent is still right
+            uint32_t rounded = f + 0xfff + (f >> 13 & 1);
+            return sign | (uint16_t)(((rounded >> 23) - 112) << 10 | (rounded >> 13 & 0x3ff));
+        }
+
+        static float from_half(uint16_t h)
+        {
+            float sign = h & 0x8000 ? -1.0f : 1.0f;
+            int exponent = h >> 10 & 0x1f;
+            int mantissa = h & 0x3ff;
+            if (exponent == 0)
+                return sign * std::ldexp((float)mantissa, -24);
+            if (exponent == 31)
+                return sign * INFINITY;
+            return sign * std::ldexp((float)(mantissa | 0x400), exponent - 25);
+        }
+    };
+}
@@ -15,7 +15,7 @@ struct fragment_shader_payload
         texture = nullptr;
     }
 
-    fragment_shader_payload(const Eigen::Vector3f& col, const Eigen::Vector3f& nor,const Eigen::Vector2f& tc, Texture* tex) :
+    fragment_shader_payload(const Eigen::Vector3f& col, const Eigen::Vector3f& nor,const Eigen::Vector2f& tc, const Texture* tex) :
          color(col), normal(nor), tex_coords(tc), texture(tex) {}
 
 
@@ -23,7 +23,10 @@ struct fragment_shader_payload
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
-    Texture* texture;
+    // how tex_coords changes from this pixel to the next one in x and in y (for mipmapping)
+    Eigen::Vector2f tex_coords_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_coords_dy = Eigen::Vector2f::Zero();
+    const Texture* texture;
 };
 
 struct vertex_shader_payload
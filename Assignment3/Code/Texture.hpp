@@ -5,16 +5,81 @@
 #ifndef RASTERIZER_TEXTURE_H
 #define RASTERIZER_TEXTURE_H
 #include "global.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
 class Texture{
 private:
-    cv::Mat image_data;
+    // One level of the mip pyramid. Texels are packed RGBA8 and stored in 4x4 tiles: a tile is 64
+    // bytes, one cache line, so the 2x2 texels of a bilinear fetch nearly always share a line.
+    struct MipLevel
+    {
+        int width, height, tiles_x;
+        std::vector<uint32_t> texels;
+
+        MipLevel(int w, int h) : width(w), height(h), tiles_x((w + 3) / 4), texels(tiles_x * ((h + 3) / 4) * 16) {}
+
+        uint32_t& at(int x, int y) { return texels[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)]; }
+        uint32_t at(int x, int y) const { return texels[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)]; }
+    };
+
+    // levels[0] is the image, every next level half the size of the one before, down to 1x1.
+    // Rows run top to bottom like in the image, v = 1 is row 0.
+    std::vector<MipLevel> levels;
+
+    static uint32_t pack(int r, int g, int b, int a)
+    {
+        return (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16 | (uint32_t)a << 24;
+    }
+
+    static Eigen::Vector3f unpack(uint32_t c)
+    {
+        return Eigen::Vector3f(c & 0xff, c >> 8 & 0xff, c >> 16 & 0xff);
+    }
+
+    // 2x2 box filter, the last row/column is repeated for odd sizes
+    static MipLevel downsample(const MipLevel& src)
+    {
+        MipLevel dst(std::max(1, src.width / 2), std::max(1, src.height / 2));
+        for (int y = 0; y < dst.height; y++)
+        {
+            int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+            for (int x = 0; x < dst.width; x++)
+            {
+                int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                uint32_t c[4] = {src.at(x0, y0), src.at(x1, y0), src.at(x0, y1), src.at(x1, y1)};
+                int sum[4] = {2, 2, 2, 2};   // rounds to nearest
+                for (uint32_t texel : c)
+                    for (int k = 0; k < 4; k++)
+                        sum[k] += texel >> (8 * k) & 0xff;
+                dst.at(x, y) = pack(sum[0] / 4, sum[1] / 4, sum[2] / 4, sum[3] / 4);
+            }
+        }
+        return dst;
+    }
+
+    // bilinear filtering between the 4 texel centers around (u, v), clamped at the edges
+    static Eigen::Vector3f bilinear(const MipLevel& level, float u, float v)
+    {
+        float x = std::min(std::max(u * level.width - 0.5f, -1.0f), (float)level.width);
+        float y = std::min(std::max((1 - v) * level.height - 0.5f, -1.0f), (float)level.height);
+        float fx = std::floor(x), fy = std::floor(y);
+        float s = x - fx, t = y - fy;
+        int x0 = std::clamp((int)fx, 0, level.width - 1), x1 = std::clamp((int)fx + 1, 0, level.width - 1);
+        int y0 = std::clamp((int)fy, 0, level.height - 1), y1 = std::clamp((int)fy + 1, 0, level.height - 1);
+
+        Eigen::Vector3f top = unpack(level.at(x0, y0)) * (1 - s) + unpack(level.at(x1, y0)) * s;
+        Eigen::Vector3f bottom = unpack(level.at(x0, y1)) * (1 - s) + unpack(level.at(x1, y1)) * s;
+        return top * (1 - t) + bottom * t;
+    }
 
 public:
     Texture(const std::string& name)
     {
-        image_data = cv::imread(name);
+        cv::Mat image_data = cv::imread(name);
         cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
         width = image_data.cols;
         height = image_data.rows;
@@ -22,11 +87,23 @@ public:
         // width = image_data.cols /2;
         // height = image_data.rows /2;
         // cv::pyrDown(image_data, image_data, cv::Size(width ,height)); //把texture下采样一倍，变为原来的二分之一分辨率
+
+        // 加载时建好整个 mip 金字塔
+        MipLevel base(width, height);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+            {
+                cv::Vec3b color = image_data.at<cv::Vec3b>(y, x);
+                base.at(x, y) = pack(color[0], color[1], color[2], 255);
+            }
+        levels.push_back(std::move(base));
+        while (levels.back().width > 1 || levels.back().height > 1)
+            levels.push_back(downsample(levels.back()));
     }
 
     int width, height;
 
-    Eigen::Vector3f getColor(float u, float v)
+    Eigen::Vector3f getColor(float u, float v) const
     {
         // auto  u_img = u * width;
         // auto v_img = (1 - v) * height;
@@ -37,37 +114,33 @@ public:
         if (v_img < 0) v_img = 0;
         if (v_img >= height) v_img = height-1;
 
-        cv::Vec3b color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        return unpack(levels[0].at(u_img, v_img));
     }
 
-    int rangeSafe(int x,bool sel){
-        if(x<0) return 0;
-        if(x>width && sel) return width-1;
-        if(x>width && !sel) return height-1; 
-        return x;
+    Eigen::Vector3f getColorBilinear(float u,float v) const   //双线性插值
+    {
+        return bilinear(levels[0], u, v);
     }
 
-    Eigen::Vector3f getColorBilinear(float u,float v)   //双线性插值
+    // Trilinear filtering (三线性插值): duv_dx and duv_dy are how far (u, v) moves from one pixel to the
+    // next on screen in x and in y. The mip level is the one where that step is about one texel, and
+    // the two levels around it are filtered bilinearly and blended.
+    Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f& duv_dx, const Eigen::Vector2f& duv_dy) const
     {
-        float u_img = u * width;
-        float v_img = (1-v) * height;
-
-        int min_u=rangeSafe(floor(u_img),true);
-        int max_u=rangeSafe(ceil(u_img),true);
-        int min_v=rangeSafe(floor(v_img),false);
-        int max_v=rangeSafe(ceil(v_img),false);
-
-        cv::Vec3b u00= image_data.at<cv::Vec3b>(max_v,min_u); //opencv的坐标在左上角，并且读取的时候先y,后x
-        cv::Vec3b u01= image_data.at<cv::Vec3b>(min_v,min_u);
-        cv::Vec3b u11= image_data.at<cv::Vec3b>(min_v,max_u);
-        cv::Vec3b u10= image_data.at<cv::Vec3b>(max_v,max_u);
-
-        cv::Vec3b lerp_s_bot= (u_img-min_u)/(max_u-min_u)*u10 + (1-(u_img-min_u))/(max_u-min_u)* u00;
-        cv::Vec3b lerp_s_top= (u_img-min_u)/(max_u-min_u)*u11 + (1-(u_img-min_u))/(max_u-min_u)* u01;
+        float step_x = std::hypot(duv_dx.x() * width, duv_dx.y() * height);
+        float step_y = std::hypot(duv_dy.x() * width, duv_dy.y() * height);
+        float lod = std::log2(std::max(step_x, step_y));
+        // magnified (or no derivatives at all)
+        if (!(lod > 0))
+            return bilinear(levels[0], u, v);
+        lod = std::min(lod, (float)(levels.size() - 1));
 
-        cv::Vec3b lerp_t=(v_img-min_v)/(max_v-min_v)*lerp_s_bot + (1-(v_img-min_v))/(max_v-min_v)* lerp_s_top;
-        return Eigen::Vector3f (lerp_t[0],lerp_t[1],lerp_t[2]);
+        int level = (int)lod;
+        float t = lod - level;
+        Eigen::Vector3f color = bilinear(levels[level], u, v);
+        if (t == 0)
+            return color;
+        return color * (1 - t) + bilinear(levels[level + 1], u, v) * t;
     }
 
 };
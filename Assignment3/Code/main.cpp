@@ -1,4 +1,9 @@
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -144,7 +149,8 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     {
         // TODO: Get the texture value at the texture coordinates of the current fragment
         // return_color=payload.texture->getColor(payload.tex_coords.x(),payload.tex_coords.y());//单查询
-        return_color=payload.texture->getColorBilinear(payload.tex_coords.x(),payload.tex_coords.y());//双线性插值
+        // return_color=payload.texture->getColorBilinear(payload.tex_coords.x(),payload.tex_coords.y());//双线性插值
+        return_color=payload.texture->getColorTrilinear(payload.tex_coords.x(),payload.tex_coords.y(),payload.tex_coords_dx,payload.tex_coords_dy);//三线性插值, mipmap
     }
     Eigen::Vector3f texture_color;
     texture_color << return_color.x(), return_color.y(), return_color.z();
@@ -156,7 +162,7 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
     auto l1 = light{{20, 20, 20}, {500, 500, 500}};
     auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
 
-    std::vector<light> lights = {l1, l2};
+    std::array<light, 2> lights = {l1, l2}; // 定长数组，每个片元不再分配堆内存
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -196,7 +202,7 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
     auto l1 = light{{20, 20, 20}, {500, 500, 500}};
     auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
 
-    std::vector<light> lights = {l1, l2};
+    std::array<light, 2> lights = {l1, l2}; // 定长数组，每个片元不再分配堆内存
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -238,7 +244,7 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
     auto l1 = light{{20, 20, 20}, {500, 500, 500}};
     auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
 
-    std::vector<light> lights = {l1, l2};
+    std::array<light, 2> lights = {l1, l2}; // 定长数组，每个片元不再分配堆内存
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -319,10 +325,6 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     Eigen::Vector3f kd = payload.color;
     Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
 
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
     Eigen::Vector3f amb_light_intensity{10, 10, 10};
     Eigen::Vector3f eye_pos{0, 0, 10};
 
@@ -398,81 +400,365 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
     return result_color * 255.f;
 }
 
-int main(int argc, const char** argv)
+// Draws with the shader as a type of its own (the lambda), so it is inlined into the raster loop.
+// deferred: fill the G-buffer first, then shade every visible pixel once
+template <Eigen::Vector3f (*Shader)(const fragment_shader_payload&)>
+void draw_with(rst::rasterizer& r, rst::pos_buf_id pos_id, rst::ind_buf_id ind_id, bool deferred)
 {
-    std::vector<Triangle*> TriangleList;
+    auto shader = [](const fragment_shader_payload& payload) { return Shader(payload); };
+    if (deferred)
+    {
+        r.draw_gbuffer(pos_id, ind_id);
+        r.shade_gbuffer(shader);
+    }
+    else
+        r.draw(pos_id, ind_id, shader);
+}
 
-    float angle = 140.0;
-    bool command_line = false;
+// A mesh as indexed buffers, a vertex shared by several triangles is stored once
+struct mesh
+{
+    std::vector<Eigen::Vector3f> positions, normals;
+    std::vector<Eigen::Vector2f> tex_coords;
+    std::vector<Eigen::Vector3i> indices;
+};
 
-    std::string filename = "output.png";
+mesh load_mesh(const std::string& path)
+{
+    mesh m;
     objl::Loader Loader;
-    std::string obj_path = "../models/spot/";
-
-    // Load .obj File
-    bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
-    //bool loadout = Loader.LoadFile("../models/bunny/bunny.obj");
+    Loader.LoadFile(path);
 
+    // OBJ_Loader gives every triangle its own 3 vertices, equal ones are merged here
+    std::map<std::array<float, 8>, int> vertex_index;
+    bool has_normals = false;
     for(auto mesh:Loader.LoadedMeshes)
     {
         for(int i=0;i<mesh.Vertices.size();i+=3)
         {
-            Triangle* t = new Triangle();
+            Eigen::Vector3i triangle;
             for(int j=0;j<3;j++)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                const objl::Vertex& vertex = mesh.Vertices[i+j];
+                std::array<float, 8> key = {vertex.Position.X, vertex.Position.Y, vertex.Position.Z,
+                                            vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z,
+                                            vertex.TextureCoordinate.X, vertex.TextureCoordinate.Y};
+                auto it = vertex_index.emplace(key, (int)m.positions.size()).first;
+                if (it->second == (int)m.positions.size())
+                {
+                    m.positions.emplace_back(vertex.Position.X, vertex.Position.Y, vertex.Position.Z);
+                    m.normals.emplace_back(vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z);
+                    m.tex_coords.emplace_back(vertex.TextureCoordinate.X, vertex.TextureCoordinate.Y);
+                    has_normals = has_normals || m.normals.back() != Eigen::Vector3f::Zero();
+                }
+                triangle[j] = it->second;
+            }
+            m.indices.push_back(triangle);
+        }
+    }
+
+    // no normals in the file (bunny): every vertex gets the area weighted average of its faces' normals
+    if (!has_normals)
+    {
+        for (const auto& t : m.indices)
+        {
+            Eigen::Vector3f face = (m.positions[t[1]] - m.positions[t[0]]).cross(m.positions[t[2]] - m.positions[t[0]]);
+            for (int j = 0; j < 3; j++)
+                m.normals[t[j]] += face;
+        }
+        for (auto& normal : m.normals)
+            normal.normalize();
+    }
+    return m;
+}
+
+// the mesh moved to the origin and scaled to spot's size, so every model fills about as much of the screen
+mesh load_fitted_mesh(const std::string& path)
+{
+    mesh m = load_mesh(path);
+    Eigen::Vector3f lo = m.positions[0], hi = m.positions[0];
+    for (const auto& p : m.positions)
+    {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    Eigen::Vector3f center = (lo + hi) / 2;
+    float scale = 2 / (hi - lo).maxCoeff();
+    for (auto& p : m.positions)
+        p = (p - center) * scale;
+    return m;
+}
+
+using scene_drawer = void (*)(rst::rasterizer&, rst::pos_buf_id, rst::ind_buf_id, bool);
+
+// Headless benchmark (Rasterizer bench [frames] [file.json]): every model turns once around in
+// frames frames, drawn with every shader, forward and deferred, then a crowd of spots. Nothing is
+// shown or written but the results, one JSON object: frames per second, the average time per frame
+// of each stage, and triangles and fragments per second.
+void run_benchmark(int frames, std::ostream& out)
+{
+    struct bench_model
+    {
+        const char* name;
+        std::string obj, texture, height_map;
+    };
+    // bunny has no texture coordinates, its texture lookups all land on one texel.
+    // The crate is cube.obj with the crate's texture: Crate1.obj is made of quads, which OBJ_Loader
+    // splits into too few triangles.
+    const bench_model models[] = {
+        {"spot", "../models/spot/spot_triangulated_good.obj", "../models/spot/spot_texture.png", "../models/spot/hmap.jpg"},
+        {"bunny", "../models/bunny/bunny.obj", "../models/spot/spot_texture.png", "../models/spot/hmap.jpg"},
+        {"crate", "../models/cube/cube.obj", "../models/Crate/crate_1.jpg", "../models/spot/hmap.jpg"},
+    };
+    struct bench_shader
+    {
+        const char* name;
+        scene_drawer draw;
+        bool color_texture;   // samples the model's texture, the others the height map
+    };
+    const bench_shader shaders[] = {
+        {"normal", draw_with<normal_fragment_shader>, false},
+        {"phong", draw_with<phong_fragment_shader>, false},
+        {"texture", draw_with<texture_fragment_shader>, true},
+        {"bump", draw_with<bump_fragment_shader>, false},
+        {"displacement", draw_with<displacement_fragment_shader>, false},
+    };
+
+    const int width = 700, height = 700;
+    Eigen::Vector3f eye_pos = {0,0,10};
+
+    auto setup = [&](rst::rasterizer& r, const mesh& m) {
+        auto ids = std::make_pair(r.load_positions(m.positions), r.load_indices(m.indices));
+        r.load_normals(m.normals);
+        r.load_tex_coords(m.tex_coords);
+        r.set_vertex_shader(vertex_shader);
+        r.set_cull(rst::Cull::Back);
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        return ids;
+    };
+
+    out << "{\n  \"width\": " << width << ", \"height\": " << height << ", \"frames\": " << frames << ",\n  \"runs\": [";
+    bool first = true;
+    // times frames calls of draw_frame(frame) and writes a run
+    auto measure = [&](rst::rasterizer& r, const char* model, const char* shader, const char* mode, const auto& draw_frame) {
+        // one frame first, so the buffers have their size before anything is timed
+        draw_frame(0);
+        r.reset_stats();
+
+        double output_ms = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            draw_frame(frame);
+            auto output_start = std::chrono::steady_clock::now();
+            r.frame_buffer().bgra8();
+            output_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - output_start).count();
+        }
+        double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        const rst::render_stats& stats = r.statistics();
+        double seconds = total_ms / 1000;
+
+        out << (first ? "\n" : ",\n") << "    {\"model\": \"" << model << "\", \"shader\": \"" << shader
+            << "\", \"mode\": \"" << mode << "\""
+            << ", \"fps\": " << frames / seconds << ", \"frame_ms\": " << total_ms / frames
+            << ",\n     \"stage_ms\": {\"vertex\": " << stats.vertex_ms / frames << ", \"setup\": " << stats.setup_ms / frames
+            << ", \"raster\": " << stats.raster_ms / frames << ", \"shading\": " << stats.shading_ms / frames
+            << ", \"output\": " << output_ms / frames << "}"
+            << ",\n     \"triangles\": " << stats.triangles / frames << ", \"drawn_triangles\": " << stats.drawn_triangles / frames
+            << ", \"fragments\": " << stats.fragments / frames
+            << ", \"triangles_per_s\": " << stats.triangles / seconds << ", \"fragments_per_s\": " << stats.fragments / seconds << "}";
+        first = false;
+    };
+
+    for (const auto& model : models)
+    {
+        mesh m = load_fitted_mesh(model.obj);
+        rst::rasterizer r(width, height);
+        auto [pos_id, ind_id] = setup(r, m);
+        Texture texture(model.texture), height_map(model.height_map);
+
+        for (const auto& shader : shaders)
+        {
+            r.set_texture(shader.color_texture ? texture : height_map);
+            for (bool deferred : {false, true})
+            {
+                measure(r, model.name, shader.name, deferred ? "deferred" : "forward", [&](int frame) {
+                    r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                    r.set_model(get_model_matrix(140.0f + 360.0f * frame / frames));
+                    shader.draw(r, pos_id, ind_id, deferred);
+                });
             }
-            TriangleList.push_back(t);
         }
     }
 
+    // A crowd of 10 x 10 small spots, every one turning, as one instanced draw and as a draw per spot
+    {
+        mesh m = load_fitted_mesh(models[0].obj);
+        rst::rasterizer r(width, height);
+        auto [pos_id, ind_id] = setup(r, m);
+        auto shader = [](const fragment_shader_payload& payload) { return phong_fragment_shader(payload); };
+
+        const int rows = 10;
+        std::vector<Eigen::Matrix4f> crowd(rows * rows);
+        std::vector<Eigen::Vector3f> colors(rows * rows);
+        auto place = [&](int frame) {
+            for (int i = 0; i < rows * rows; ++i)
+            {
+                Eigen::Matrix4f placement = Eigen::Matrix4f::Identity();
+                placement.topLeftCorner<3, 3>() *= 0.14f;
+                placement.topRightCorner<3, 1>() << (i % rows - 4.5f) * 0.8f, (i / rows - 4.5f) * 0.8f, 0;
+                crowd[i] = placement * get_model_matrix(140.0f + 360.0f * frame / frames + 36.0f * i);
+                colors[i] << 100 + 15 * (i % rows), 80 + 15 * (i / rows), 160;
+            }
+        };
+        measure(r, "spot crowd", "phong", "instanced", [&](int frame) {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            place(frame);
+            r.draw_instanced(pos_id, ind_id, crowd, colors, shader);
+        });
+        measure(r, "spot crowd", "phong", "separate", [&](int frame) {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            place(frame);
+            for (const auto& model : crowd)
+            {
+                r.set_model(model);
+                r.draw(pos_id, ind_id, shader);
+            }
+        });
+    }
+    out << "\n  ]\n}\n";
+}
+
+// Rasterizer check: two spots side by side with different textures, drawn with the texture shader
+// forward and deferred. Deferred shading has to give the same image, every draw_gbuffer shading
+// with the texture it was made with. Returns 0 when the images match.
+int check_deferred_textures()
+{
+    mesh m = load_fitted_mesh("../models/spot/spot_triangulated_good.obj");
+    Texture first("../models/spot/spot_texture.png"), second("../models/rock/rock.png");
+    auto shader = [](const fragment_shader_payload& payload) { return texture_fragment_shader(payload); };
+
+    std::vector<uint32_t> images[2];
+    for (bool deferred : {false, true})
+    {
+        rst::rasterizer r(700, 700);
+        auto pos_id = r.load_positions(m.positions);
+        auto ind_id = r.load_indices(m.indices);
+        r.load_normals(m.normals);
+        r.load_tex_coords(m.tex_coords);
+        r.set_cull(rst::Cull::Back);
+        r.set_view(get_view_matrix({0, 0, 10}));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            Eigen::Matrix4f placement = Eigen::Matrix4f::Identity();
+            placement(0, 3) = i == 0 ? -2.0f : 2.0f;
+            r.set_model(placement * get_model_matrix(140.0f));
+            r.set_texture(i == 0 ? first : second);
+            if (deferred)
+                r.draw_gbuffer(pos_id, ind_id);
+            else
+                r.draw(pos_id, ind_id, shader);
+        }
+        if (deferred)
+            r.shade_gbuffer(shader);
+
+        auto frame = r.frame_buffer().bgra8();
+        images[deferred].assign((uint32_t*)frame.data, (uint32_t*)frame.data + frame.width * frame.height);
+    }
+
+    int differing = 0;
+    for (size_t i = 0; i < images[0].size(); ++i)
+        differing += images[0][i] != images[1][i];
+    std::cout << "\ndeferred shading with two textures: " << differing << " pixels differ from forward shading\n";
+    return differing == 0 ? 0 : 1;
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc >= 2 && std::string(argv[1]) == "bench")
+    {
+        int frames = argc >= 3 ? std::max(1, std::atoi(argv[2])) : 60;
+        std::string path = argc >= 4 ? argv[3] : "benchmark.json";
+        // a file and not stdout, OBJ_Loader prints its progress there
+        std::ofstream file(path);
+        if (!file)
+        {
+            std::cerr << "cannot write " << path << "\n";
+            return 1;
+        }
+        run_benchmark(frames, file);
+        std::cout << "\nbenchmark results in " << path << "\n";
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "check")
+        return check_deferred_textures();
+
+    float angle = 140.0;
+    bool command_line = false;
+
+    std::string filename = "output.png";
+    std::string obj_path = "../models/spot/";
+
+    // Load .obj File
+    mesh spot = load_mesh("../models/spot/spot_triangulated_good.obj");
+    //mesh spot = load_mesh("../models/bunny/bunny.obj");
+
     rst::rasterizer r(700, 700);
+    auto pos_id = r.load_positions(spot.positions);
+    auto ind_id = r.load_indices(spot.indices);
+    r.load_normals(spot.normals);
+    r.load_tex_coords(spot.tex_coords);
 
     auto texture_path = "hmap.jpg";
     r.set_texture(Texture(obj_path + texture_path));
 
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    scene_drawer draw_scene = draw_with<phong_fragment_shader>;
+    bool deferred = false;
 
     if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
+        deferred = argc >= 4 && std::string(argv[3]) == "deferred";
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (argc >= 3 && std::string(argv[2]) == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
+            draw_scene = draw_with<texture_fragment_shader>;
             texture_path = "spot_texture.png";
             r.set_texture(Texture(obj_path + texture_path));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (argc >= 3 && std::string(argv[2]) == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            draw_scene = draw_with<normal_fragment_shader>;
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (argc >= 3 && std::string(argv[2]) == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            draw_scene = draw_with<phong_fragment_shader>;
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (argc >= 3 && std::string(argv[2]) == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            draw_scene = draw_with<bump_fragment_shader>;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (argc >= 3 && std::string(argv[2]) == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            draw_scene = draw_with<displacement_fragment_shader>;
         }
     }
 
     Eigen::Vector3f eye_pos = {0,0,10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+    // spot is closed, its back faces are always hidden behind front faces
+    r.set_cull(rst::Cull::Back);
 
     int key = 0;
     int frame_count = 0;
@@ -484,12 +770,15 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        draw_scene(r, pos_id, ind_id, deferred);
+        // 帧缓冲一次拷贝完成去分块和 8 位转换，这里直接包装该缓冲
+        auto frame = r.frame_buffer().bgra8();
+        cv::Mat image(frame.height, frame.width, CV_8UC4, frame.data, frame.stride);
+        // 输出仍为 3 通道 BGR 图像
+        cv::Mat bgr;
+        cv::cvtColor(image, bgr, cv::COLOR_BGRA2BGR);
 
-        cv::imwrite(filename, image);
+        cv::imwrite(filename, bgr);
 
         return 0;
     }
@@ -503,10 +792,10 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
         //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        draw_scene(r, pos_id, ind_id, deferred);
+        // 帧缓冲一次拷贝完成去分块和 8 位转换，这里直接包装该缓冲
+        auto frame = r.frame_buffer().bgra8();
+        cv::Mat image(frame.height, frame.width, CV_8UC4, frame.data, frame.stride);
 
         cv::imshow("image", image);
         // cv::imwrite(filename, image);
@@ -6,37 +6,46 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
-
-bool ccc=true;
+#include <stdexcept>
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    pos_buf.push_back(positions);
+    int id = (int)pos_buf.size() - 1;
 
     return {id};
 }
 
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    ind_buf.push_back(indices);
+    int id = (int)ind_buf.size() - 1;
 
     return {id};
 }
 
 rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    col_buf.push_back(cols);
+    int id = (int)col_buf.size() - 1;
+
+    return {id};
+}
+
+rst::tex_buf_id rst::rasterizer::load_tex_coords(const std::vector<Eigen::Vector2f>& tex_coords)
+{
+    tex_buf.push_back(tex_coords);
+    int id = (int)tex_buf.size() - 1;
+
+    tex_coords_id = id;
 
     return {id};
 }
 
 rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
 {
-    auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    nor_buf.push_back(normals);
+    int id = (int)nor_buf.size() - 1;
 
     normal_id = id;
 
@@ -150,200 +159,424 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(float x, float y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
-}
-
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
-}
-
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
+// Phase one of draw(TriangleList): transform the triangles to the screen and sort them into
+// the tiles their bounding boxes touch, a chunk of the list per job with bins of its own
+void rst::rasterizer::bin_triangles(std::vector<Triangle *> &TriangleList) {
+    auto start = std::chrono::steady_clock::now();
 
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
     Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
-    {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
-
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
-
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
-
-        Eigen::Vector4f v[] = {   //mvp变换后的vertex point
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();  //注意，这里vec.w()并没有成为1，于是乎，vec.w()=z_depth，对应下文的矫正
-                                
-        }
+    Eigen::Matrix4f view_model = view * model;
+    Eigen::Matrix4f inv_trans = view_model.inverse().transpose();
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+    int count = (int)TriangleList.size();
+    begin_binning(count);
+    Clipper clipper = frustum_clipper();
 
-        //Viewport transformation
-        for (auto & vert : v)
+    pool.ParallelFor(num_chunks, [&](int chunk) {
+        int begin = (int)((int64_t)count * chunk / num_chunks);
+        int end = (int)((int64_t)count * (chunk + 1) / num_chunks);
+        for (int k = begin; k < end; ++k)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;//注意，这里的z作为深度已经错误了，经过mvp变换后，z的值已经是错误的了，放缩到[n,f]自然也是错误的
-                                            //因此无法代表顶点正确的深度值，同时，经过mvp变换，如果定义 z 是到相机的距离的绝对值
-                                            //那么vert.w()应该存的是 -z . 为负数。下面算下来的w_recip也是负数
-                                            //这里有一个解决方案是，直接丢弃这个vert.z 用vert.w来代替，vert.w就是相机空间下的z值
-
-            vert.z()=-vert.z();
-        }
+            const Triangle* t = TriangleList[k];
+            Triangle newtri = *t;
+
+            std::array<Eigen::Vector4f, 3> mm {
+                    (view_model * t->v[0]),
+                    (view_model * t->v[1]),
+                    (view_model * t->v[2])
+            };
+
+            std::array<Eigen::Vector3f, 3> viewspace_pos;
+
+            std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
+                return v.template head<3>();
+            });
+
+            Eigen::Vector4f v[] = {   //mvp变换后的vertex point
+                    mvp * t->v[0],
+                    mvp * t->v[1],
+                    mvp * t->v[2]
+            };
+            // clip space, for the clipper
+            Eigen::Vector4f clip[] = {v[0], v[1], v[2]};
+            //Homogeneous division
+            for (auto& vec : v) {
+                vec.x()/=vec.w();
+                vec.y()/=vec.w();
+                vec.z()/=vec.w();  //注意，这里vec.w()并没有成为1，于是乎，vec.w()=z_depth，对应下文的矫正
+                                    
+            }
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
+            Eigen::Vector4f n[] = {
+                    inv_trans * to_vec4(t->normal[0], 0.0f),
+                    inv_trans * to_vec4(t->normal[1], 0.0f),
+                    inv_trans * to_vec4(t->normal[2], 0.0f)
+            };
+
+            //Viewport transformation
+            for (auto & vert : v)
+            {
+                vert.x() = 0.5*width*(vert.x()+1.0);
+                vert.y() = 0.5*height*(vert.y()+1.0);
+                vert.z() = vert.z() * f1 + f2;//注意，这里的z作为深度已经错误了，经过mvp变换后，z的值已经是错误的了，放缩到[n,f]自然也是错误的
+                                                //因此无法代表顶点正确的深度值，同时，经过mvp变换，如果定义 z 是到相机的距离的绝对值
+                                                //那么vert.w()应该存的是 -z . 为负数。下面算下来的w_recip也是负数
+                                                //这里有一个解决方案是，直接丢弃这个vert.z 用vert.w来代替，vert.w就是相机空间下的z值
+
+                vert.z()=-vert.z();
+            }
+
+            for (int i = 0; i < 3; ++i)
+            {
+                //screen space coordinates
+                newtri.setVertex(i, v[i]);
+            }
+
+            for (int i = 0; i < 3; ++i)
+            {
+                //view space normal
+                newtri.setNormal(i, n[i].head<3>());
+            }
+
+            newtri.setColor(0, vertex_color.x(), vertex_color.y(), vertex_color.z());
+            newtri.setColor(1, vertex_color.x(), vertex_color.y(), vertex_color.z());
+            newtri.setColor(2, vertex_color.x(), vertex_color.y(), vertex_color.z());
+
+            add_triangle(chunk, clipper, clip, newtri, viewspace_pos, 0);
         }
+    });
+    pool.Wait();
+    stats.setup_ms += elapsed_ms(start);
+    stats.triangles += count;
+    stats.drawn_triangles += binned_triangles();
+}
+
+// Vertex stage of the indexed draws: every vertex of the buffers goes through the matrices of every
+// instance once, into the post-transform buffers. A job transforms a batch of columns of one
+// instance with one 4xN matrix product per attribute, which Eigen vectorizes across the vertices.
+void rst::rasterizer::transform_vertices(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3f>* normals,
+                                         const instance* instances, int count)
+{
+    int vertices = (int)positions.size();
+    vert_clip.resize(4, (Eigen::Index)vertices * count);
+    vert_screen.resize(4, (Eigen::Index)vertices * count);
+    vert_view_pos.resize(3, (Eigen::Index)vertices * count);
+    vert_normal.resize(3, (Eigen::Index)vertices * count);
+
+    constexpr int batch = 1024;
+    int jobs_per_instance = (vertices + batch - 1) / batch;
+    pool.ParallelFor(jobs_per_instance * count, [&](int job) {
+        const instance& inst = instances[job / jobs_per_instance];
+        int begin = job % jobs_per_instance * batch;
+        int n = std::min(batch, vertices - begin);
+        Eigen::Index column = (Eigen::Index)(job / jobs_per_instance) * vertices + begin;
+        Eigen::Map<const Eigen::Matrix3Xf> pos(positions[begin].data(), 3, n);
+
+        vert_view_pos.middleCols(column, n).noalias() = inst.view_model.topRows<3>() * pos.colwise().homogeneous();
+        if (normals)
+            vert_normal.middleCols(column, n).noalias() = inst.normal_matrix * Eigen::Map<const Eigen::Matrix3Xf>((*normals)[begin].data(), 3, n);
+        else
+            vert_normal.middleCols(column, n).setZero();
+
+        vert_clip.middleCols(column, n).noalias() = inst.mvp * pos.colwise().homogeneous();
+        for (Eigen::Index i = column; i < column + n; ++i)
+            vert_screen.col(i) = to_screen(vert_clip.col(i));
+    });
+    pool.Wait();
+}
 
-        for (int i = 0; i < 3; ++i)
+// Primitive assembly of the indexed draws: the triangles of every instance are put together from
+// the post-transform buffers and binned like in bin_triangles
+void rst::rasterizer::assemble_triangles(const std::vector<Eigen::Vector3i>& indices, const std::vector<Eigen::Vector2f>* tex_coords,
+                                         const instance* instances, int count)
+{
+    int triangles = (int)indices.size();
+    int total = triangles * count;
+    int vertices = count ? (int)(vert_clip.cols() / count) : 0;
+    begin_binning(total);
+    Clipper clipper = frustum_clipper();
+
+    pool.ParallelFor(num_chunks, [&](int chunk) {
+        int begin = (int)((int64_t)total * chunk / num_chunks);
+        int end = (int)((int64_t)total * (chunk + 1) / num_chunks);
+        for (int k = begin; k < end; ++k)
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            const instance& inst = instances[k / triangles];
+            const Eigen::Vector3i& triangle = indices[k % triangles];
+            Eigen::Index base = (Eigen::Index)(k / triangles) * vertices;
+            Eigen::Index c0 = base + triangle[0], c1 = base + triangle[1], c2 = base + triangle[2];
+
+            // Culled faces go no further than a look at their screen positions, when all three
+            // vertices are in front of the camera (behind it the projection turns the winding around).
+            // Clipping keeps the winding, add_triangle would cull every piece.
+            if (cull != Cull::None && vert_view_pos(2, c0) < 0 && vert_view_pos(2, c1) < 0 && vert_view_pos(2, c2) < 0 &&
+                Clipper::culled(cull, vert_screen.col(c0).head<2>(), vert_screen.col(c1).head<2>(), vert_screen.col(c2).head<2>()))
+                continue;
+
+            Triangle newtri;
+            Eigen::Vector4f clip[3];
+            std::array<Eigen::Vector3f, 3> viewspace_pos;
+            for (int i = 0; i < 3; ++i)
+            {
+                Eigen::Index column = base + triangle[i];
+                clip[i] = vert_clip.col(column);
+                newtri.setVertex(i, vert_screen.col(column));
+                newtri.setNormal(i, vert_normal.col(column));
+                newtri.setTexCoord(i, tex_coords ? (*tex_coords)[triangle[i]] : Eigen::Vector2f::Zero());
+                newtri.setColor(i, inst.color.x(), inst.color.y(), inst.color.z());
+                viewspace_pos[i] = vert_view_pos.col(column);
+            }
+            add_triangle(chunk, clipper, clip, newtri, viewspace_pos, inst.id);
         }
+    });
+    pool.Wait();
+}
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
+std::vector<rst::rasterizer::instance> rst::rasterizer::visible_instances(pos_buf_id pos_buffer, ind_buf_id ind_buffer,
+                                                                          const std::vector<Eigen::Matrix4f>& models,
+                                                                          const std::vector<Eigen::Vector3f>& colors)
+{
+    if (!colors.empty() && colors.size() != models.size())
+        throw std::runtime_error("draw_instanced takes a color per instance or none");
+    const auto& positions = pos_buf.at(pos_buffer.pos_id);
+    stats.triangles += (int64_t)ind_buf.at(ind_buffer.ind_id).size() * models.size();
+
+    // the corners of the mesh's bounding box
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(INFINITY), hi = Eigen::Vector3f::Constant(-INFINITY);
+    for (const auto& p : positions)
+    {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    Eigen::Vector4f corners[8];
+    for (int i = 0; i < 8; ++i)
+        corners[i] << (i & 1 ? hi.x() : lo.x()), (i & 2 ? hi.y() : lo.y()), (i & 4 ? hi.z() : lo.z()), 1;
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+    Clipper clipper = frustum_clipper();
+    std::vector<instance> visible;
+    for (int i = 0; i < (int)models.size(); ++i)
+    {
+        instance inst;
+        inst.view_model = view * models[i];
+        inst.mvp = projection * inst.view_model;
+        Eigen::Vector4f clip[8];
+        for (int j = 0; j < 8; ++j)
+            clip[j] = inst.mvp * corners[j];
+        if (positions.empty() || clipper.outside(clip, 8))
+            continue;
+        inst.normal_matrix = inst.view_model.inverse().transpose().topLeftCorner<3, 3>();
+        inst.color = colors.empty() ? vertex_color : colors[i];
+        inst.id = i;
+        visible.push_back(inst);
     }
+    return visible;
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+void rst::rasterizer::prepare_instances(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const instance* instances, int count)
 {
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+    const auto& positions = pos_buf.at(pos_buffer.pos_id);
+    const auto& indices = ind_buf.at(ind_buffer.ind_id);
+    auto start = std::chrono::steady_clock::now();
+    transform_vertices(positions, normal_id < 0 ? nullptr : &nor_buf.at(normal_id), instances, count);
+    stats.vertex_ms += elapsed_ms(start);
+
+    start = std::chrono::steady_clock::now();
+    assemble_triangles(indices, tex_coords_id < 0 ? nullptr : &tex_buf.at(tex_coords_id), instances, count);
+    stats.setup_ms += elapsed_ms(start);
+    stats.drawn_triangles += binned_triangles();
 }
 
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+int64_t rst::rasterizer::binned_triangles() const
 {
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
-
-    u /= weight;
-    v /= weight;
+    int64_t count = 0;
+    for (int chunk = 0; chunk < num_chunks; ++chunk)
+        count += screen_tris[chunk].size();
+    return count;
+}
 
-    return Eigen::Vector2f(u, v);
+void rst::rasterizer::begin_binning(int count)
+{
+    num_chunks = std::max(1, std::min(4 * pool.Size(), count / 256));
+    if ((int)bins.size() < num_chunks)
+    {
+        bins.resize(num_chunks);
+        screen_tris.resize(num_chunks);
+        screen_view_pos.resize(num_chunks);
+        screen_instance.resize(num_chunks);
+    }
+    for (int chunk = 0; chunk < num_chunks; ++chunk)
+    {
+        bins[chunk].resize(hiz_tiles_x * hiz_tiles_y);
+        for (auto& bin : bins[chunk])
+            bin.clear();
+        screen_tris[chunk].clear();
+        screen_view_pos[chunk].clear();
+        screen_instance[chunk].clear();
+    }
 }
 
-static Eigen::Vector3f new_interpolate(const float &alpha, const float &beta, const float &gamma, const Eigen::Vector3f &vert1, const Eigen::Vector3f &vert2,const Eigen::Vector3f &vert3, const float &Zp, const float &Za,const float &Zb, const float &Zc, const float &weight)
+rst::Clipper rst::rasterizer::frustum_clipper() const
 {
-    return (alpha * vert1/Za + beta * vert2/Zb + gamma * vert3/Zc ) * Zp /weight;
+    // the guard band ends where the screen coordinates get too big for TriangleSetup
+    return Clipper(projection, TriangleSetup::max_coord / std::max(width, height));
 }
-static Eigen::Vector2f new_interpolate(const float &alpha, const float &beta, const float &gamma, const Eigen::Vector2f &vert1, const Eigen::Vector2f &vert2,const Eigen::Vector2f &vert3, const float &Zp, const float &Za,const float &Zb, const float &Zc, const float &weight)
+
+Eigen::Vector4f rst::rasterizer::to_screen(const Eigen::Vector4f& clip) const
 {
-    return (alpha * vert1/Za + beta * vert2/Zb + gamma * vert3/Zc ) * Zp /weight;
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    // homogeneous division and viewport as in bin_triangles, w stays the view space depth
+    Eigen::Vector4f vert = clip;
+    vert.x() = 0.5*width*(clip.x()/clip.w()+1.0);
+    vert.y() = 0.5*height*(clip.y()/clip.w()+1.0);
+    vert.z() = -(clip.z()/clip.w() * f1 + f2);
+    return vert;
 }
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+// Culls and clips t, then bins what is left of it. t has the screen space vertices, clip the same
+// vertices in clip space.
+void rst::rasterizer::add_triangle(int chunk, const Clipper& clipper, const Eigen::Vector4f* clip,
+                                   const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int instance_id)
 {
-    // TODO: From your HW3, get the triangle rasterization code.
-    // TODO: Inside your rasterization loop:
-    //    * v[i].w() is the vertex view space depth value z.
-    //    * Z is interpolated view space depth for the current pixel
-    //    * zp is depth between zNear and zFar, used for z-buffer
+    auto emit = [&](const Triangle& piece, const std::array<Eigen::Vector3f, 3>& piece_view_pos) {
+        if (Clipper::culled(cull, piece.v[0].head<2>(), piece.v[1].head<2>(), piece.v[2].head<2>()))
+            return;
+        screen_tris[chunk].push_back(piece);
+        screen_view_pos[chunk].push_back(piece_view_pos);
+        screen_instance[chunk].push_back(instance_id);
+        bin_triangle(chunk, (int)screen_tris[chunk].size() - 1);
+    };
+
+    Clipper::Vertex polygon[Clipper::max_vertices];
+    int count = 0;
+    switch (clipper.clip(clip, polygon, count))
+    {
+        case Clipper::Outside:
+            return;
+        case Clipper::Inside:
+            emit(t, view_pos);
+            return;
+        case Clipper::Clipped:
+            break;
+    }
 
-    // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    // zp *= Z;
+    // the polygon as a fan of triangles around its first vertex, with attributes weighted like the positions
+    Triangle piece = t;
+    std::array<Eigen::Vector3f, 3> piece_view_pos;
+    for (int i = 1; i + 1 < count; ++i)
+    {
+        const Clipper::Vertex* corner[3] = {&polygon[0], &polygon[i], &polygon[i + 1]};
+        for (int j = 0; j < 3; ++j)
+        {
+            const Eigen::Vector3f& b = corner[j]->weights;
+            piece.setVertex(j, to_screen(corner[j]->pos));
+            piece.normal[j] = interpolate(b[0], b[1], b[2], t.normal[0], t.normal[1], t.normal[2], 1);
+            piece.color[j] = interpolate(b[0], b[1], b[2], t.color[0], t.color[1], t.color[2], 1);
+            piece.tex_coords[j] = interpolate(b[0], b[1], b[2], t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1);
+            piece_view_pos[j] = interpolate(b[0], b[1], b[2], view_pos[0], view_pos[1], view_pos[2], 1);
+        }
+        emit(piece, piece_view_pos);
+    }
+}
 
-    // TODO: Interpolate the attributes:
-    // auto interpolated_color
-    // auto interpolated_normal
-    // auto interpolated_texcoords
-    // auto interpolated_shadingcoords
+// bin by the pixel range rasterize_triangle will visit, clipped to the screen
+void rst::rasterizer::bin_triangle(int chunk, int k)
+{
+    const auto& v = screen_tris[chunk][k].v;
+    float min_x = std::floor(std::min(std::min(v[0].x(), v[1].x()), v[2].x()));
+    float max_x = std::ceil(std::max(std::max(v[0].x(), v[1].x()), v[2].x()));
+    float min_y = std::floor(std::min(std::min(v[0].y(), v[1].y()), v[2].y()));
+    float max_y = std::ceil(std::max(std::max(v[0].y(), v[1].y()), v[2].y()));
+    if (!(min_x < width && max_x > 0 && min_y < height + 1 && max_y > 1))
+        return;
+    int tx0 = (int)std::max(min_x, 0.f) / tile_size;
+    int tx1 = ((int)std::min(max_x, (float)width) - 1) / tile_size;
+    int ty0 = ((int)std::max(min_y, 1.f) - 1) / tile_size;
+    int ty1 = ((int)std::min(max_y, (float)height + 1) - 2) / tile_size;
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+            bins[chunk][ty * hiz_tiles_x + tx].push_back(k);
+}
 
-    // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-    // Use: payload.view_pos = interpolated_shadingcoords;
-    // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-    // Use: auto pixel_color = fragment_shader(payload);
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList)
+{
+    draw(TriangleList, fragment_shader);
+}
 
-    //find the bounding box:
-    auto v=t.toVector4();
-    
+void rst::rasterizer::draw_gbuffer(std::vector<Triangle *> &TriangleList)
+{
+    // every vertex has vertex_color, so the interpolated color is the material's
+    int id = (int)materials.size();
+    materials.push_back({vertex_color / 255.f, texture});
+
+    bin_triangles(TriangleList);
+    draw_tiles([&](int, int, int index, int, const fragment_shader_payload& payload) {
+        gbuffer[index] = {payload.normal, payload.view_pos, payload.tex_coords, payload.tex_coords_dx, payload.tex_coords_dy, id};
+    });
+}
 
-    float min_x = std::min(std::min(t.a()[0],t.b().x()),t.c().x());
-    float max_x = std::max(std::max(t.a()[0],t.b().x()),t.c().x());
-    float min_y = std::min(t.a()[1],std::min(t.b()[1],t.c()[1]));
-    float max_y = std::max(t.a()[1],std::max(t.b()[1],t.c()[1]));
+void rst::rasterizer::draw_gbuffer(pos_buf_id pos_buffer, ind_buf_id ind_buffer)
+{
+    draw_gbuffer_instanced(pos_buffer, ind_buffer, {model}, {});
+}
 
-    min_x=(int)std::floor(min_x);
-    max_x=(int)std::ceil(max_x);
-    min_y=(int)std::floor(min_y);
-    max_y=(int)std::ceil(max_y);
+void rst::rasterizer::draw_gbuffer_instanced(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                                             const std::vector<Eigen::Vector3f>& colors)
+{
+    // a material per instance, instance i is materials[first + i]
+    int first = (int)materials.size();
+    for (size_t i = 0; i < models.size(); ++i)
+        materials.push_back({(colors.size() == models.size() ? colors[i] : vertex_color) / 255.f, texture});
+
+    draw_instances(pos_buffer, ind_buffer, models, colors, [&](int, int, int index, int instance_id, const fragment_shader_payload& payload) {
+        gbuffer[index] = {payload.normal, payload.view_pos, payload.tex_coords, payload.tex_coords_dx, payload.tex_coords_dy, first + instance_id};
+    });
+}
 
+void rst::rasterizer::shade_gbuffer()
+{
+    shade_gbuffer(fragment_shader);
+}
 
-    for(int x=min_x;x<max_x;x++)
+void rst::rasterizer::update_hiz(int x0, int y0, int x1, int y1, uint64_t dirty)
+{
+    if(!dirty)
+        return;
+    constexpr int blocks_per_tile = tile_size / TriangleSetup::block_size;
+    float far = -std::numeric_limits<float>::infinity();
+    for(int by = 0; by < blocks_per_tile; by++)
     {
-        for(int y=min_y;y<max_y;y++){
-            Eigen::Vector2i point(x,y);
-            if(insideTriangle((float)x+0.5f,(float)y+0.5f,t.v)){
-                auto [alpha, beta, gamma] = computeBarycentric2D(x+0.5f, y+0.5f, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                if(ccc) {std::cout<<w_reciprocal; ccc=false;}
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal; //这里的z深度取了绝对值，越小越靠近相机
-
-                // auto normal_interpolated = alpha * t.normal[0] + beta * t.normal[1] + gamma * t.normal[2];
-                auto normal_interpolated = new_interpolate(alpha,beta,gamma,t.normal[0],t.normal[1],t.normal[2],w_reciprocal,v[0].w(),v[1].w(),v[2].w(),1);
-                // auto color_interpolated = alpha * t.color[0] + beta * t.color[1] + gamma * t.color[2];
-                auto color_interpolated = new_interpolate(alpha,beta,gamma,t.color[0],t.color[1],t.color[2],w_reciprocal,v[0].w(),v[1].w(),v[2].w(),1);
-                // auto textureCoord_interpolated = alpha * t.tex_coords[0] + beta * t.tex_coords[1] + gamma * t.tex_coords[2];
-                auto textureCoord_interpolated = new_interpolate(alpha,beta,gamma,t.tex_coords[0],t.tex_coords[1],t.tex_coords[2],w_reciprocal,v[0].w(),v[1].w(),v[2].w(),1);
-                // auto shadingcoords_interpolated = alpha * view_pos[0] + beta * view_pos[1] + gamma * view_pos[2];
-                auto shadingcoords_interpolated = new_interpolate(alpha,beta,gamma,view_pos[0],view_pos[1],view_pos[2],w_reciprocal,v[0].w(),v[1].w(),v[2].w(),1);
-
-                if(z_interpolated < depth_buf[get_index(x,y)])
-                {
-                    fragment_shader_payload payload(color_interpolated,normal_interpolated.normalized(),textureCoord_interpolated,texture ? &*texture : nullptr);
-                    payload.view_pos=shadingcoords_interpolated;
-                    auto pixel_color=fragment_shader(payload);
-                    set_pixel(point,pixel_color);
-                    depth_buf[get_index(x,y)]=z_interpolated;
-                }   
-            }
+        for(int bx = 0; bx < blocks_per_tile; bx++)
+        {
+            int block_x = x0 + bx * TriangleSetup::block_size, block_y = y0 + by * TriangleSetup::block_size;
+            if(block_x >= x1 || block_y >= y1)
+                continue;
+            if(dirty >> (by * blocks_per_tile + bx) & 1)
+                update_hiz_block(block_x, block_y);
+            far = std::max(far, hiz_block[(block_y - 1) / TriangleSetup::block_size * hiz_blocks_x + block_x / TriangleSetup::block_size]);
         }
     }
+    hiz_tile[(y0 - 1) / tile_size * hiz_tiles_x + x0 / tile_size] = far;
+}
+
+void rst::rasterizer::update_hiz_block(int x0, int y0)
+{
+    float far = -std::numeric_limits<float>::infinity();
+    for(int y = y0; y < std::min(y0 + TriangleSetup::block_size, height + 1); y++)
+        for(int x = x0; x < std::min(x0 + TriangleSetup::block_size, width); x++)
+            far = std::max(far, depth_buf[get_index(x, y)]);
+    hiz_block[(y0 - 1) / TriangleSetup::block_size * hiz_blocks_x + x0 / TriangleSetup::block_size] = far;
 }   
 
+void rst::rasterizer::set_cull(Cull mode)
+{
+    cull = mode;
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -363,40 +596,39 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        frame_buf.clear(Eigen::Vector3f{0, 0, 0});
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_block.begin(), hiz_block.end(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_tile.begin(), hiz_tile.end(), std::numeric_limits<float>::infinity());
+        for (auto& sample : gbuffer)
+            sample.material = -1;
+        materials.clear();
     }
 }
 
-rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
+rst::rasterizer::rasterizer(int w, int h, Format format) : frame_buf(w, h, format), width(w), height(h)
 {
-    frame_buf.resize(w * h);
     depth_buf.resize(w * h);
-
-    texture = std::nullopt;
-}
-
-int rst::rasterizer::get_index(int x, int y)
-{
-    return (height-y)*width + x;
-}
-
-void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
-{
-    //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    gbuffer.resize(w * h);
+    for (auto& sample : gbuffer)
+        sample.material = -1;
+
+    hiz_blocks_x = (w + TriangleSetup::block_size - 1) / TriangleSetup::block_size;
+    hiz_tiles_x = (w + tile_size - 1) / tile_size;
+    hiz_tiles_y = (h + tile_size - 1) / tile_size;
+    hiz_block.assign(hiz_blocks_x * ((h + TriangleSetup::block_size - 1) / TriangleSetup::block_size), std::numeric_limits<float>::infinity());
+    hiz_tile.assign(hiz_tiles_x * hiz_tiles_y, std::numeric_limits<float>::infinity());
 }
 
-void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
+void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(const vertex_shader_payload&)> vert_shader)
 {
     vertex_shader = vert_shader;
 }
 
-void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader)
+void rst::rasterizer::set_fragment_shader(std::function<Eigen::Vector3f(const fragment_shader_payload&)> frag_shader)
 {
     fragment_shader = frag_shader;
 }
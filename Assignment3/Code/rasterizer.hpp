@@ -5,11 +5,17 @@
 #pragma once
 
 #include <eigen3/Eigen/Eigen>
-#include <optional>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
+#include "ThreadPool.hpp"
+#include "TriangleSetup.hpp"
+#include "Clipper.hpp"
+#include "FrameBuffer.hpp"
 
 using namespace Eigen;
 
@@ -57,37 +63,160 @@ namespace rst
         int col_id = 0;
     };
 
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    // What the draws since the last reset_stats cost. Times are wall clock milliseconds per stage.
+    // A forward draw shades while it rasterizes, so its shading is in raster_ms; only the deferred
+    // draws have it apart in shading_ms. draw(TriangleList) transforms and assembles in one pass,
+    // counted in setup_ms.
+    struct render_stats
+    {
+        double vertex_ms = 0;      // vertex transform of the indexed draws
+        double setup_ms = 0;       // primitive assembly, clipping, culling and binning
+        double raster_ms = 0;      // tiles: triangle setup, coverage, depth test (and forward shading)
+        double shading_ms = 0;     // shade_gbuffer
+        int64_t triangles = 0;     // triangles given to the draws
+        int64_t drawn_triangles = 0;   // what is left of them after clipping and culling
+        int64_t fragments = 0;     // fragments that passed the depth test
+    };
+
     class rasterizer
     {
     public:
-        rasterizer(int w, int h);
+        rasterizer(int w, int h, Format format = Format::RGBA8);
         pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
         ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
         col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
         col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        tex_buf_id load_tex_coords(const std::vector<Eigen::Vector2f>& tex_coords);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
+        // back face culling is off until this says otherwise
+        void set_cull(Cull mode);
 
-        void set_texture(Texture tex) { texture = tex; }
+        // Later draws use tex. A draw_gbuffer keeps the texture it was made with until shade_gbuffer,
+        // whatever is set after it.
+        void set_texture(Texture tex) { texture = std::make_shared<const Texture>(std::move(tex)); }
 
-        void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
-        void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
+        void set_vertex_shader(std::function<Eigen::Vector3f(const vertex_shader_payload&)> vert_shader);
+        void set_fragment_shader(std::function<Eigen::Vector3f(const fragment_shader_payload&)> frag_shader);
 
-        void set_pixel(const Vector2i &point, const Eigen::Vector3f &color);
+        void set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
+        {
+            //old index: auto ind = point.y() + point.x() * width;
+            frame_buf.set(point.x(), point.y() - 1, color);
+        }
 
         void clear(Buffers buff);
 
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
+        // draws with the shader given to set_fragment_shader
         void draw(std::vector<Triangle *> &TriangleList);
+        // Draws with shader(const fragment_shader_payload&) as the fragment shader. Its type is known
+        // at compile time, so a shader function object is inlined into the raster loop instead of
+        // being called through std::function for every fragment.
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, const Shader& shader);
+        // Indexed draw: the triangles are the index triples of ind_buffer into pos_buffer and into the
+        // normals and texture coordinates loaded last (load_normals, load_tex_coords). Every vertex is
+        // transformed once for the draw, however many triangles share it.
+        template <typename Shader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const Shader& shader);
+        // Instanced draw (实例化绘制): the mesh of the indexed draw once per matrix of models, which
+        // take the place of the model matrix. colors[i] (0-255) is the vertex color of instance i;
+        // without colors every instance has the vertex color of the other draws. All instances go
+        // through one vertex stage, one binning and one pass over the tiles, an instance whose
+        // bounding box is outside the view is dropped before its vertices are transformed. Gives the
+        // image of a set_model + draw per instance, in the order of models.
+        template <typename Shader>
+        void draw_instanced(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                            const std::vector<Eigen::Vector3f>& colors, const Shader& shader);
+
+        // Deferred shading. draw_gbuffer rasterizes like draw, but for the nearest fragment of every
+        // pixel it only keeps what a shader needs (normal, view space position, texture coordinates
+        // and a material) in the G-buffer. shade_gbuffer then runs the shader once per covered pixel,
+        // so shading costs as much as the covered pixels, however often triangles overlap them.
+        void draw_gbuffer(std::vector<Triangle *> &TriangleList);
+        void draw_gbuffer(pos_buf_id pos_buffer, ind_buf_id ind_buffer);
+        void draw_gbuffer_instanced(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                                    const std::vector<Eigen::Vector3f>& colors);
+        void shade_gbuffer();
+        template <typename Shader>
+        void shade_gbuffer(const Shader& shader);
+
+        FrameBuffer& frame_buffer() { return frame_buf; }
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        const render_stats& statistics() const { return stats; }
+        void reset_stats() { stats = {}; }
+
+        // draw(TriangleList) cuts the screen into square tiles of this many pixels
+        static constexpr int tile_size = 32;
+        // at most this many triangles of an instanced draw are binned at a time
+        static constexpr int max_batch_triangles = 1 << 16;
+        static_assert(tile_size % TriangleSetup::block_size == 0, "tiles are made of whole hierarchical z blocks");
+        static_assert(tile_size == FrameBuffer::tile_size, "a tile draws to one tile of the frame buffer");
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        void bin_triangles(std::vector<Triangle *> &TriangleList);
+
+        // an instance of an instanced draw, with its matrices
+        struct instance
+        {
+            Eigen::Matrix4f mvp, view_model;
+            Eigen::Matrix3f normal_matrix;
+            Eigen::Vector3f color;   // 0-255
+            int id;                  // its place in the models of the draw
+        };
+        // The instances of models that can be seen. Counts the triangles of all of them in the stats.
+        std::vector<instance> visible_instances(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                                                const std::vector<Eigen::Vector3f>& colors);
+        // Draws the instances batch by batch, each one as many instances as fit into
+        // max_batch_triangles, which bounds the memory of the binned triangles.
+        template <typename Output>
+        void draw_instances(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                            const std::vector<Eigen::Vector3f>& colors, const Output& output);
+        // the indexed draws' way to the same binned triangles: vertex stage, then primitive assembly
+        void prepare_instances(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const instance* instances, int count);
+        void transform_vertices(const std::vector<Eigen::Vector3f>& positions, const std::vector<Eigen::Vector3f>* normals,
+                                const instance* instances, int count);
+        void assemble_triangles(const std::vector<Eigen::Vector3i>& indices, const std::vector<Eigen::Vector2f>* tex_coords,
+                                const instance* instances, int count);
+        // empty bins for count triangles, then put screen_tris[chunk][k] into the bins of chunk
+        void begin_binning(int count);
+        void add_triangle(int chunk, const Clipper& clipper, const Eigen::Vector4f* clip,
+                          const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos, int instance_id);
+        void bin_triangle(int chunk, int k);
+        Clipper frustum_clipper() const;
+        // clip space to screen space
+        Eigen::Vector4f to_screen(const Eigen::Vector4f& clip) const;
+
+        // Rasterizes the binned triangles tile by tile. output(x, y, index, instance, payload) gets every
+        // fragment that passes the depth test, index is its place in the depth buffer and G-buffer,
+        // instance the id of the instance the triangle belongs to (0 outside instanced draws).
+        template <typename Output>
+        void draw_tiles(const Output& output);
+        // only pixels with x0 <= x < x1 and y0 <= y < y1 are touched, (x0, y0) is the corner of a tile
+        template <typename Output>
+        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos,
+                                int x0, int y0, int x1, int y1, const Output& output);
+        // recompute the hierarchical z of the tile at (x0, y0) after the blocks in dirty were drawn to
+        void update_hiz(int x0, int y0, int x1, int y1, uint64_t dirty);
+        // recompute the hierarchical z of the block with corner (x0, y0) from the depth buffer
+        void update_hiz_block(int x0, int y0);
+        // triangles in screen_tris after binning
+        int64_t binned_triangles() const;
+
+        static double elapsed_ms(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -96,25 +225,280 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
+        Cull cull = Cull::None;
+
         int normal_id = -1;
+        int tex_coords_id = -1;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        // a flat array of buffers per kind, a buffer id is the slot of its buffer
+        std::vector<std::vector<Eigen::Vector3f>> pos_buf;
+        std::vector<std::vector<Eigen::Vector3i>> ind_buf;
+        std::vector<std::vector<Eigen::Vector3f>> col_buf;
+        std::vector<std::vector<Eigen::Vector3f>> nor_buf;
+        std::vector<std::vector<Eigen::Vector2f>> tex_buf;
 
-        std::optional<Texture> texture;
+        std::shared_ptr<const Texture> texture;
 
-        std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
-        std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
+        std::function<Eigen::Vector3f(const fragment_shader_payload&)> fragment_shader;
+        std::function<Eigen::Vector3f(const vertex_shader_payload&)> vertex_shader;
 
-        std::vector<Eigen::Vector3f> frame_buf;
+        // pixel (x, y) of the rasterizer is (x, y - 1) here, see get_index
+        FrameBuffer frame_buf;
         std::vector<float> depth_buf;
-        int get_index(int x, int y);
+        int get_index(int x, int y) { return (height-y)*width + x; }
+
+        // Hierarchical z: the farthest depth in the depth buffer per 8x8 block (block (x / 8, (y - 1) / 8))
+        // and per tile. A triangle whose nearest point is not nearer than that fails the depth test
+        // everywhere in the block or tile, so it is dropped there before any per pixel work.
+        std::vector<float> hiz_block;
+        std::vector<float> hiz_tile;
+        int hiz_blocks_x, hiz_tiles_x, hiz_tiles_y;
+
+        // draw(TriangleList) state between binning and rasterizing, per chunk of the list: the
+        // triangles in screen space after culling and clipping, their view space vertices and
+        // instance ids, and bins[chunk][tile] the indices of the chunk's triangles overlapping the
+        // tile, in list order
+        std::vector<std::vector<Triangle>> screen_tris;
+        std::vector<std::vector<std::array<Eigen::Vector3f, 3>>> screen_view_pos;
+        std::vector<std::vector<int>> screen_instance;
+        std::vector<std::vector<std::vector<int>>> bins;
+        int num_chunks = 0;
+
+        // post-transform vertex buffers of an indexed draw, a column per vertex and instance (the
+        // vertices of an instance one after the other): clip space and screen position (w is the
+        // view space depth), view space position and view space normal
+        Eigen::Matrix4Xf vert_clip;
+        Eigen::Matrix4Xf vert_screen;
+        Eigen::Matrix3Xf vert_view_pos;
+        Eigen::Matrix3Xf vert_normal;
+
+        // the color bin_triangles gives every vertex, 0-255
+        const Eigen::Vector3f vertex_color{148, 121, 92};
+
+        struct gbuffer_sample
+        {
+            Eigen::Vector3f normal;
+            Eigen::Vector3f view_pos;
+            Eigen::Vector2f tex_coords;
+            Eigen::Vector2f tex_coords_dx, tex_coords_dy;
+            int material;   // index into materials, -1 where nothing was drawn
+        };
+        // what a draw_gbuffer call shades with besides the geometry
+        struct material
+        {
+            Eigen::Vector3f color;
+            std::shared_ptr<const Texture> texture;
+        };
+        // indexed like depth_buf
+        std::vector<gbuffer_sample> gbuffer;
+        std::vector<material> materials;
 
         int width, height;
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        render_stats stats;
+
+        ThreadPool pool;
     };
+    inline Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+    {
+        return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+    }
+
+    inline Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+    {
+        auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
+        auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+
+        u /= weight;
+        v /= weight;
+
+        return Eigen::Vector2f(u, v);
+    }
+
+    // Two phases. First the triangles are transformed and sorted into the screen tiles their
+    // bounding boxes touch (bin_triangles). Then the tiles are rasterized and shaded independently:
+    // a tile only writes its own pixels of the frame and depth buffers, so neither phase needs a
+    // lock. Inside a tile the triangles are drawn in list order, which gives the same image as
+    // drawing them one after another.
+    template <typename Shader>
+    void rasterizer::draw(std::vector<Triangle *> &TriangleList, const Shader& shader)
+    {
+        bin_triangles(TriangleList);
+        draw_tiles([&](int x, int y, int, int, const fragment_shader_payload& payload) {
+            frame_buf.set(x, y - 1, shader(payload));
+        });
+    }
+
+    template <typename Shader>
+    void rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const Shader& shader)
+    {
+        // a single instance in the model matrix
+        draw_instanced(pos_buffer, ind_buffer, {model}, {}, shader);
+    }
+
+    template <typename Shader>
+    void rasterizer::draw_instanced(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                                    const std::vector<Eigen::Vector3f>& colors, const Shader& shader)
+    {
+        draw_instances(pos_buffer, ind_buffer, models, colors, [&](int x, int y, int, int, const fragment_shader_payload& payload) {
+            frame_buf.set(x, y - 1, shader(payload));
+        });
+    }
+
+    template <typename Output>
+    void rasterizer::draw_instances(pos_buf_id pos_buffer, ind_buf_id ind_buffer, const std::vector<Eigen::Matrix4f>& models,
+                                    const std::vector<Eigen::Vector3f>& colors, const Output& output)
+    {
+        std::vector<instance> visible = visible_instances(pos_buffer, ind_buffer, models, colors);
+        int triangles = std::max<int>(1, ind_buf.at(ind_buffer.ind_id).size());
+        int per_batch = std::max(1, max_batch_triangles / triangles);
+        // nothing to see still leaves one empty batch, which clears the bins of the last draw
+        int first = 0;
+        do
+        {
+            int count = std::min(per_batch, (int)visible.size() - first);
+            prepare_instances(pos_buffer, ind_buffer, visible.data() + first, count);
+            draw_tiles(output);
+            first += count;
+        } while (first < (int)visible.size());
+    }
+
+    template <typename Shader>
+    void rasterizer::shade_gbuffer(const Shader& shader)
+    {
+        auto start = std::chrono::steady_clock::now();
+        // a job per tile, like draw_tiles
+        pool.ParallelFor(hiz_tiles_x * hiz_tiles_y, [&](int tile) {
+            int x0 = (tile % hiz_tiles_x) * tile_size;
+            int y0 = (tile / hiz_tiles_x) * tile_size + 1;
+            for (int y = y0; y < std::min(y0 + tile_size, height + 1); ++y)
+            {
+                for (int x = x0; x < std::min(x0 + tile_size, width); ++x)
+                {
+                    const gbuffer_sample& sample = gbuffer[get_index(x, y)];
+                    if (sample.material < 0)
+                        continue;
+                    const material& m = materials[sample.material];
+                    fragment_shader_payload payload(m.color, sample.normal, sample.tex_coords, m.texture.get());
+                    payload.view_pos = sample.view_pos;
+                    payload.tex_coords_dx = sample.tex_coords_dx;
+                    payload.tex_coords_dy = sample.tex_coords_dy;
+                    frame_buf.set(x, y - 1, shader(payload));
+                }
+            }
+        });
+        pool.Wait();
+        stats.shading_ms += elapsed_ms(start);
+    }
+
+    template <typename Output>
+    void rasterizer::draw_tiles(const Output& output)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::atomic<int64_t> fragments{0};
+        pool.ParallelFor(hiz_tiles_x * hiz_tiles_y, [&](int tile) {
+            // pixel rows are y = 1..height, see get_index
+            int x0 = (tile % hiz_tiles_x) * tile_size;
+            int y0 = (tile / hiz_tiles_x) * tile_size + 1;
+            int x1 = std::min(x0 + tile_size, width);
+            int y1 = std::min(y0 + tile_size, height + 1);
+            // counted per tile, one atomic add per job
+            int64_t count = 0;
+            for (int chunk = 0; chunk < num_chunks; ++chunk)
+                for (int k : bins[chunk][tile])
+                {
+                    int instance_id = screen_instance[chunk][k];
+                    // Also pass view space vertice position
+                    rasterize_triangle(screen_tris[chunk][k], screen_view_pos[chunk][k], x0, y0, x1, y1,
+                                       [&](int x, int y, int index, const fragment_shader_payload& payload) {
+                                           ++count;
+                                           output(x, y, index, instance_id, payload);
+                                       });
+                }
+            fragments += count;
+        });
+        pool.Wait();
+        stats.fragments += fragments;
+        stats.raster_ms += elapsed_ms(start);
+    }
+
+    //Screen space rasterization
+    template <typename Output>
+    void rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                                        int x0, int y0, int x1, int y1, const Output& output)
+    {
+        // TODO: From your HW3, get the triangle rasterization code.
+        // TODO: Inside your rasterization loop:
+        //    * v[i].w() is the vertex view space depth value z.
+        //    * Z is interpolated view space depth for the current pixel
+        //    * zp is depth between zNear and zFar, used for z-buffer
+
+        // float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
+        // float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
+        // zp *= Z;
+
+        // TODO: Interpolate the attributes:
+        // auto interpolated_color
+        // auto interpolated_normal
+        // auto interpolated_texcoords
+        // auto interpolated_shadingcoords
+
+        // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture.get());
+        // Use: payload.view_pos = interpolated_shadingcoords;
+        // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
+        // Use: auto pixel_color = fragment_shader(payload);
+
+        auto v=t.toVector4();
+
+        // no fragment is nearer than the nearest vertex (less a little for rounding in the interpolation)
+        float z_min = std::min(v[0].z(), std::min(v[1].z(), v[2].z()));
+        z_min -= 1e-4f * std::abs(z_min);
+        if(z_min >= hiz_tile[(y0 - 1) / tile_size * hiz_tiles_x + x0 / tile_size])
+            return;
+
+        TriangleSetup setup;
+        if(!setup.setup(t.v))
+            return;
+
+        constexpr int blocks_per_tile = tile_size / TriangleSetup::block_size;
+        // blocks of the tile that got new depth, bit by * blocks_per_tile + bx
+        uint64_t dirty = 0;
+
+        static const int center[1][2] = {{TriangleSetup::sub_one / 2, TriangleSetup::sub_one / 2}};
+        setup.walk(x0, y0, x1, y1, center, 1, [&](int x, int y, const uint32_t* cover) {
+            float alphas[TriangleSetup::block_size], betas[TriangleSetup::block_size], gammas[TriangleSetup::block_size], ws[TriangleSetup::block_size];
+            setup.barycentric_span(x, y, alphas, betas, gammas, ws);
+            for(int i = 0; i < TriangleSetup::block_size; i++)
+            {
+                if(!(cover[0] >> i & 1))
+                    continue;
+                int index = get_index(x + i, y);
+                float alpha = alphas[i], beta = betas[i], gamma = gammas[i], w = ws[i];
+                float z_interpolated = alpha * v[0].z() + beta * v[1].z() + gamma * v[2].z(); //这里的z深度取了绝对值，越小越靠近相机
+
+                if(z_interpolated < depth_buf[index])
+                {
+                    // alpha, beta, gamma are already perspective correct, the attributes are interpolated linearly with them
+                    auto normal_interpolated = interpolate(alpha,beta,gamma,t.normal[0],t.normal[1],t.normal[2],1);
+                    auto color_interpolated = interpolate(alpha,beta,gamma,t.color[0],t.color[1],t.color[2],1);
+                    auto textureCoord_interpolated = interpolate(alpha,beta,gamma,t.tex_coords[0],t.tex_coords[1],t.tex_coords[2],1);
+                    auto shadingcoords_interpolated = interpolate(alpha,beta,gamma,view_pos[0],view_pos[1],view_pos[2],1);
+
+                    fragment_shader_payload payload(color_interpolated,normal_interpolated.normalized(),textureCoord_interpolated,texture.get());
+                    payload.view_pos=shadingcoords_interpolated;
+                    Eigen::Vector3f ddx, ddy;
+                    setup.barycentric_gradient(alpha, beta, gamma, w, ddx, ddy);
+                    payload.tex_coords_dx = interpolate(ddx.x(),ddx.y(),ddx.z(),t.tex_coords[0],t.tex_coords[1],t.tex_coords[2],1);
+                    payload.tex_coords_dy = interpolate(ddy.x(),ddy.y(),ddy.z(),t.tex_coords[0],t.tex_coords[1],t.tex_coords[2],1);
+                    output(x + i, y, index, payload);
+                    depth_buf[index]=z_interpolated;
+                    dirty |= uint64_t(1) << ((y - y0) / TriangleSetup::block_size * blocks_per_tile + (x - x0) / TriangleSetup::block_size);
+                }
+            }
+        }, [&](int bx, int by) {
+            return z_min < hiz_block[(by - 1) / TriangleSetup::block_size * hiz_blocks_x + bx / TriangleSetup::block_size];
+        });
+
+        update_hiz(x0, y0, x1, y1, dirty);
+    }
 }
@@ -0,0 +1,262 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "Vector.hpp"
+#include "Object.hpp"
+#include "global.hpp"
+
+// Uniform grid over the primitives of all objects (spheres, mesh triangles).
+// Every cell lists the primitives whose bounds overlap it, and a ray walks
+// the cells it passes through in order with the 3D-DDA of Amanatides and
+// Woo, "A Fast Voxel Traversal Algorithm for Ray Tracing" (1987). A
+// primitive can span several cells and may be hit beyond the current one,
+// so a hit only ends the walk once the ray has passed its distance.
+class Grid
+{
+public:
+    explicit Grid(const std::vector<std::unique_ptr<Object> >& objects)
+    {
+        struct Prim
+        {
+            Object* object;
+            uint32_t index;
+            Vector3f pMin, pMax;
+        };
+        std::vector<Prim> prims;
+        Vector3f worldMin(kInfinity), worldMax(-kInfinity);
+        for (const auto& object : objects)
+        {
+            for (uint32_t k = 0; k < object->getPrimitiveCount(); ++k)
+            {
+                Prim p{object.get(), k, Vector3f(), Vector3f()};
+                object->getPrimitiveBounds(k, p.pMin, p.pMax);
+                worldMin = Vector3f::Min(worldMin, p.pMin);
+                worldMax = Vector3f::Max(worldMax, p.pMax);
+                prims.push_back(p);
+            }
+        }
+        if (prims.empty())
+            return;
+
+        // pad the box so flat scenes (a single plane) still have volume
+        Vector3f diag = worldMax - worldMin;
+        float pad = 1e-3f * std::max(diag.x, std::max(diag.y, diag.z)) + 1e-4f;
+        worldMin = worldMin - Vector3f(pad);
+        worldMax = worldMax + Vector3f(pad);
+        diag = worldMax - worldMin;
+
+        // about 3 * cbrt(N) cells along the longest axis, cubic cells otherwise
+        float maxAxis = std::max(diag.x, std::max(diag.y, diag.z));
+        float cellsPerUnit = 3 * std::cbrt((float)prims.size()) / maxAxis;
+        for (int a = 0; a < 3; ++a)
+        {
+            pMin[a] = worldMin[a];
+            pMax[a] = worldMax[a];
+            nCells[a] = std::max(1, std::min(maxCells, (int)std::lround(diag[a] * cellsPerUnit)));
+            cellSize[a] = diag[a] / nCells[a];
+            invCellSize[a] = nCells[a] / diag[a];
+        }
+
+        // count the references per cell, then fill them in
+        cellStart.assign(nCells[0] * nCells[1] * nCells[2] + 1, 0);
+        auto forEachCell = [&](const Prim& p, auto&& func) {
+            int lo[3], hi[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = CellIndex(p.pMin[a], a);
+                hi[a] = CellIndex(p.pMax[a], a);
+            }
+            for (int z = lo[2]; z <= hi[2]; ++z)
+                for (int y = lo[1]; y <= hi[1]; ++y)
+                    for (int x = lo[0]; x <= hi[0]; ++x)
+                        func((z * nCells[1] + y) * nCells[0] + x);
+        };
+        for (const auto& p : prims)
+            forEachCell(p, [&](int c) { ++cellStart[c + 1]; });
+        for (size_t c = 1; c < cellStart.size(); ++c)
+            cellStart[c] += cellStart[c - 1];
+        refs.resize(cellStart.back());
+        std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+        for (const auto& p : prims)
+            forEachCell(p, [&](int c) { refs[fill[c]++] = {p.object, p.index}; });
+    }
+
+    // Closest hit along the ray, with the same outputs as trace() in Renderer.cpp
+    bool intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, uint32_t& index, Vector2f& uv,
+                   Object** hitObject) const
+    {
+        Walk w;
+        if (!Start(orig, dir, w))
+            return false;
+
+        bool hit = false;
+        tNear = kInfinity;
+        while (true)
+        {
+            int c = (w.cell[2] * nCells[1] + w.cell[1]) * nCells[0] + w.cell[0];
+            for (uint32_t r = cellStart[c]; r < cellStart[c + 1]; ++r)
+            {
+                float tK = kInfinity;
+                uint32_t indexK;
+                Vector2f uvK;
+                if (refs[r].object->intersectPrimitive(refs[r].index, orig, dir, tK, indexK, uvK) && tK < tNear)
+                {
+                    hit = true;
+                    tNear = tK;
+                    index = indexK;
+                    uv = uvK;
+                    *hitObject = refs[r].object;
+                }
+            }
+            // nothing in a later cell can be closer than a hit inside this one
+            if (hit && tNear <= w.Exit())
+                return true;
+            if (!Step(w))
+                return hit;
+        }
+    }
+
+    // Whether anything lies on the ray closer than maxDist (dir normalized).
+    // Stops at the first primitive found and reports it through
+    // hitObject/prim.
+    bool occluded(const Vector3f& orig, const Vector3f& dir, float maxDist, Object** hitObject,
+                  uint32_t& prim) const
+    {
+        Walk w;
+        if (!Start(orig, dir, w))
+            return false;
+        while (true)
+        {
+            int c = (w.cell[2] * nCells[1] + w.cell[1]) * nCells[0] + w.cell[0];
+            for (uint32_t r = cellStart[c]; r < cellStart[c + 1]; ++r)
+            {
+                float tK = kInfinity;
+                uint32_t indexK = 0;
+                Vector2f uvK;
+                if (refs[r].object->intersectPrimitive(refs[r].index, orig, dir, tK, indexK, uvK) && tK < maxDist)
+                {
+                    *hitObject = refs[r].object;
+                    prim = refs[r].index;
+                    return true;
+                }
+            }
+            // the next cell starts beyond maxDist
+            if (w.Exit() >= maxDist || !Step(w))
+                return false;
+        }
+    }
+
+private:
+    struct Ref
+    {
+        Object* object;
+        uint32_t index;
+    };
+    static constexpr int maxCells = 128;
+
+    // state of the 3D-DDA: the current cell, and per axis the distance at
+    // which the ray crosses into the next cell and between two crossings
+    struct Walk
+    {
+        int cell[3], step[3], out[3];
+        float tMax[3], tDelta[3];
+        int axis;   // the axis crossed next
+
+        float Exit() const { return tMax[axis]; }
+    };
+
+    // Clip the ray to the grid box and find the first cell; false if it misses
+    bool Start(const Vector3f& orig, const Vector3f& dir, Walk& w) const
+    {
+        if (refs.empty())
+            return false;
+        // refract() under total internal reflection gives a NaN direction, it hits nothing
+        if (!std::isfinite(dir.x) || !std::isfinite(dir.y) || !std::isfinite(dir.z))
+            return false;
+
+        // clip the ray against the grid box
+        float t0 = 0, t1 = kInfinity;
+        for (int a = 0; a < 3; ++a)
+        {
+            float o = orig[a], d = dir[a];
+            if (d == 0)
+            {
+                if (o < pMin[a] || o > pMax[a])
+                    return false;
+                continue;
+            }
+            float tNearA = (pMin[a] - o) / d, tFarA = (pMax[a] - o) / d;
+            if (tNearA > tFarA)
+                std::swap(tNearA, tFarA);
+            t0 = std::max(t0, tNearA);
+            t1 = std::min(t1, tFarA);
+            if (t0 > t1)
+                return false;
+        }
+
+        for (int a = 0; a < 3; ++a)
+        {
+            float p = orig[a] + dir[a] * t0;
+            w.cell[a] = CellIndex(p, a);
+            if (dir[a] > 0)
+            {
+                w.step[a] = 1;
+                w.out[a] = nCells[a];
+                w.tMax[a] = t0 + (pMin[a] + (w.cell[a] + 1) * cellSize[a] - p) / dir[a];
+                w.tDelta[a] = cellSize[a] / dir[a];
+            }
+            else if (dir[a] < 0)
+            {
+                w.step[a] = -1;
+                w.out[a] = -1;
+                w.tMax[a] = t0 + (pMin[a] + w.cell[a] * cellSize[a] - p) / dir[a];
+                w.tDelta[a] = -cellSize[a] / dir[a];
+            }
+            else
+            {
+                w.step[a] = 0;
+                w.out[a] = -1;
+                w.tMax[a] = kInfinity;
+                w.tDelta[a] = kInfinity;
+            }
+        }
+        w.axis = NextAxis(w);
+        return true;
+    }
+
+    static int NextAxis(const Walk& w)
+    {
+        return w.tMax[0] < w.tMax[1] ? (w.tMax[0] < w.tMax[2] ? 0 : 2) : (w.tMax[1] < w.tMax[2] ? 1 : 2);
+    }
+
+    // Move to the next cell; false once the ray leaves the grid
+    bool Step(Walk& w) const
+    {
+        int a = w.axis;
+        // along an axis the direction does not move on, the ray never leaves its cell
+        if (w.step[a] == 0)
+            return false;
+        w.cell[a] += w.step[a];
+        if (w.cell[a] == w.out[a])
+            return false;
+        w.tMax[a] += w.tDelta[a];
+        w.axis = NextAxis(w);
+        return true;
+    }
+
+    int CellIndex(float p, int axis) const
+    {
+        int c = (int)((p - pMin[axis]) * invCellSize[axis]);
+        return std::max(0, std::min(nCells[axis] - 1, c));
+    }
+
+    float pMin[3], pMax[3];
+    float cellSize[3], invCellSize[3];
+    int nCells[3];
+    // references of cell c are refs[cellStart[c]] .. refs[cellStart[c + 1] - 1]
+    std::vector<uint32_t> cellStart;
+    std::vector<Ref> refs;
+};
@@ -27,6 +27,22 @@ public:
         return diffuseColor;
     }
 
+    // The grid (Grid.hpp) stores objects primitive by primitive: a sphere is a
+    // single primitive, a mesh has one per triangle.
+    virtual uint32_t getPrimitiveCount() const
+    {
+        return 1;
+    }
+
+    virtual void getPrimitiveBounds(uint32_t prim, Vector3f& pMin, Vector3f& pMax) const = 0;
+
+    // same as intersect, but only against primitive prim
+    virtual bool intersectPrimitive(uint32_t, const Vector3f& orig, const Vector3f& dir, float& tnear,
+                                    uint32_t& index, Vector2f& uv) const
+    {
+        return intersect(orig, dir, tnear, index, uv);
+    }
+
     // material properties
     MaterialType materialType;
     float ior;
@@ -3,6 +3,8 @@
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include <optional>
+#include <cstring>
+#include <vector>
 
 inline float deg2rad(const float &deg)
 { return deg * M_PI/180.0; }
@@ -81,12 +83,30 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
     // kt = 1 - kr;
 }
 
+// Uniform number in [0, 1) hashed from a ray, so stochastic choices are the same on
+// every run whatever thread renders the pixel.
+inline float hashToFloat(const Vector3f &orig, const Vector3f &dir)
+{
+    uint32_t h = 2166136261u;   // FNV-1a over the bits of both vectors
+    const float v[6] = {orig.x, orig.y, orig.z, dir.x, dir.y, dir.z};
+    for (float f : v)
+    {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        h = (h ^ bits) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return (h >> 8) * (1.0f / (1 << 24));
+}
+
 // [comment]
 // Returns true if the ray intersects an object, false otherwise.
 //
 // \param orig is the ray origin
 // \param dir is the ray direction
-// \param objects is the list of objects the scene contains
+// \param scene is the scene; its grid is used when built, otherwise every object is tested
 // \param[out] tNear contains the distance to the cloesest intersected object.
 // \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
 // \param[out] uv stores the u and v barycentric coordinates of the intersected point
@@ -95,11 +115,18 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
 // [/comment]
 std::optional<hit_payload> trace(
         const Vector3f &orig, const Vector3f &dir,
-        const std::vector<std::unique_ptr<Object> > &objects)
+        const Scene &scene)
 {
     float tNear = kInfinity;
     std::optional<hit_payload> payload;
-    for (const auto & object : objects)
+    if (const Grid *grid = scene.get_grid())
+    {
+        hit_payload hit;
+        if (grid->intersect(orig, dir, hit.tNear, hit.index, hit.uv, &hit.hit_obj))
+            payload = hit;
+        return payload;
+    }
+    for (const auto & object : scene.get_objects())
     {
         float tNearK = kInfinity;
         uint32_t indexK;
@@ -118,6 +145,82 @@ std::optional<hit_payload> trace(
     return payload;
 }
 
+// [comment]
+// Shadow test of one point against n lights at once: inShadow[i] is set if anything lies
+// within dists[i] of orig along dirs[i] (normalized).
+//
+// Every light first retries whatever blocked its last shadow ray on this thread. Nearby
+// pixels are mostly shadowed by the same thing, so that settles most tests with a single
+// intersection. The lights left over go through the grid, or through one pass over the
+// objects that ends as soon as all of them are blocked. Either way a light is done at
+// its first occluder; the closest one is not needed.
+// [/comment]
+void occludedLights(const Scene &scene, const Vector3f &orig, const Vector3f *dirs, const float *dists,
+                    size_t n, char *inShadow)
+{
+    struct Occluder
+    {
+        Object *object = nullptr;
+        uint32_t prim = 0;
+    };
+    thread_local const Scene *cacheScene = nullptr;
+    thread_local std::vector<Occluder> lastOccluder;
+    thread_local std::vector<size_t> open;
+    if (cacheScene != &scene || lastOccluder.size() != n)
+    {
+        lastOccluder.assign(n, Occluder());
+        cacheScene = &scene;
+    }
+
+    open.clear();
+    for (size_t i = 0; i < n; ++i)
+    {
+        const Occluder &o = lastOccluder[i];
+        float t = kInfinity;
+        uint32_t index;
+        Vector2f uv;
+        inShadow[i] = o.object && o.object->intersectPrimitive(o.prim, orig, dirs[i], t, index, uv) && t < dists[i];
+        if (!inShadow[i])
+            open.push_back(i);
+    }
+    if (open.empty())
+        return;
+
+    if (const Grid *grid = scene.get_grid())
+    {
+        for (size_t i : open)
+        {
+            Occluder hit;
+            if (grid->occluded(orig, dirs[i], dists[i], &hit.object, hit.prim))
+            {
+                inShadow[i] = true;
+                lastOccluder[i] = hit;
+            }
+        }
+        return;
+    }
+    size_t blocked = 0;
+    for (const auto &object : scene.get_objects())
+    {
+        for (size_t i : open)
+        {
+            if (inShadow[i])
+                continue;
+            float t = kInfinity;
+            uint32_t index = 0;
+            Vector2f uv;
+            if (object->intersect(orig, dirs[i], t, index, uv) && t < dists[i])
+            {
+                inShadow[i] = true;
+                lastOccluder[i] = {object.get(), index};
+                ++blocked;
+            }
+        }
+        if (blocked == open.size())
+            break;
+    }
+}
+
 // [comment]
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
@@ -133,17 +236,22 @@ std::optional<hit_payload> trace(
 //
 // If the surface is diffuse/glossy we use the Phong illumation model to compute the color
 // at the intersection point.
+//
+// weight is how much the returned color counts in the final pixel. Branches whose weight
+// would fall below scene.minWeight are skipped; that changes the pixel by weight times the
+// radiance the branch would have returned, so less than one step of the 8-bit output only
+// where that radiance is at most 1 (bright highlights can move a channel by a few steps).
 // [/comment]
 Vector3f castRay(
         const Vector3f &orig, const Vector3f &dir, const Scene& scene,
-        int depth)
+        int depth, float weight = 1)
 {
     if (depth > scene.maxDepth) {
         return Vector3f(0.0,0.0,0.0);
     }
 
     Vector3f hitColor = scene.backgroundColor;
-    if (auto payload = trace(orig, dir, scene.get_objects()); payload)
+    if (auto payload = trace(orig, dir, scene); payload)
     {
         Vector3f hitPoint = orig + dir * payload->tNear;
         Vector3f N; // normal
@@ -161,9 +269,22 @@ Vector3f castRay(
                 Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ?
                                              hitPoint - N * scene.epsilon :
                                              hitPoint + N * scene.epsilon;
-                Vector3f reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1);
-                Vector3f refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1);
                 float kr = fresnel(dir, N, payload->hit_obj->ior);
+                if (scene.stochasticFresnel)
+                {
+                    // pick one branch with probability kr / 1 - kr; dividing by that
+                    // probability cancels the Fresnel factor
+                    if (hashToFloat(orig, dir) < kr)
+                        hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, weight);
+                    else
+                        hitColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1, weight);
+                    break;
+                }
+                Vector3f reflectionColor = 0, refractionColor = 0;
+                if (weight * kr >= scene.minWeight)
+                    reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, weight * kr);
+                if (weight * (1 - kr) >= scene.minWeight)
+                    refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1, weight * (1 - kr));
                 hitColor = reflectionColor * kr + refractionColor * (1 - kr);
                 break;
             }
@@ -174,7 +295,9 @@ Vector3f castRay(
                 Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ?
                                              hitPoint + N * scene.epsilon :
                                              hitPoint - N * scene.epsilon;
-                hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1) * kr;
+                hitColor = 0;
+                if (weight * kr >= scene.minWeight)
+                    hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1, weight * kr) * kr;
                 break;
             } 
             default: // DIFFUSE AND GLOSSY
@@ -188,26 +311,36 @@ Vector3f castRay(
                                           hitPoint + N * scene.epsilon :
                                           hitPoint - N * scene.epsilon ;
           //      Vector3f shadowPointOrig =  hitPoint + N * scene.epsilon;                          
+                // is the point in shadow, and is the nearest occluding object closer to the object
+                // than the light itself? All lights are tested in one go, see occludedLights()
+                const auto& lights = scene.get_lights();
+                thread_local std::vector<Vector3f> lightDirs;
+                thread_local std::vector<float> lightDistances;
+                thread_local std::vector<char> inShadow;
+                lightDirs.resize(lights.size());
+                lightDistances.resize(lights.size());
+                inShadow.resize(lights.size());
+                for (size_t i = 0; i < lights.size(); ++i) {
+                    Vector3f lightDir = lights[i]->position - hitPoint;     // 由击中点指向光源
+                    lightDistances[i] = std::sqrt(dotProduct(lightDir, lightDir));
+                    lightDirs[i] = normalize(lightDir); // 单位化lightdir
+                }
+                occludedLights(scene, shadowPointOrig, lightDirs.data(), lightDistances.data(), lights.size(),
+                               inShadow.data());
+
                 // [comment]
                 // Loop over all lights in the scene and sum their contribution up
                 // We also apply the lambert cosine law
                 // [/comment]
-                for (auto& light : scene.get_lights()) {
-                    Vector3f lightDir = light->position - hitPoint;     // 由击中点指向光源
-                    // square of the distance between hitPoint and the light
-                    float lightDistance2 = dotProduct(lightDir, lightDir);  // r^2
-                    lightDir = normalize(lightDir); // 单位化lightdir
+                for (size_t i = 0; i < lights.size(); ++i) {
+                    const Vector3f& lightDir = lightDirs[i];
                     float LdotN = std::max(0.f, dotProduct(lightDir, N));  // 法向量与光的夹角余弦
-                    // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                    auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
-                    bool inShadow = shadow_res 
-                    && (shadow_res->tNear * shadow_res->tNear < lightDistance2); // 排除碰到了比光源还远的物体的情况
 
-                    lightAmt += inShadow ? 0 : light->intensity * LdotN;  // diffuse
+                    lightAmt += inShadow[i] ? 0 : lights[i]->intensity * LdotN;  // diffuse
                     Vector3f reflectionDirection = reflect(-lightDir, N); // 光源指向击中点 
 
                     specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, dir)),
-                        payload->hit_obj->specularExponent)      * light->intensity;
+                        payload->hit_obj->specularExponent)      * lights[i]->intensity;
                 }
 
                 hitColor = lightAmt * payload->hit_obj->evalDiffuseColor(st) * payload->hit_obj->Kd + specularColor * payload->hit_obj->Ks;
@@ -224,6 +357,10 @@ Vector3f castRay(
 // The main render function. This where we iterate over all pixels in the image, generate
 // primary rays and cast these rays into the scene. The content of the framebuffer is
 // saved to a file.
+//
+// The image is cut into tiles that the pool's workers take one at a time. Every pixel
+// only depends on its own ray, so the image is the same whatever the thread count. The
+// workers just count finished tiles; this thread draws the progress bar from that count.
 // [/comment]
 void Renderer::Render(const Scene& scene)
 {
@@ -234,26 +371,37 @@ void Renderer::Render(const Scene& scene)
 
     // Use this variable as the eye position to start your rays.
     Vector3f eye_pos(0);
-    int m = 0;
-    for (int j = 0; j < scene.height; ++j)
-    {
-        for (int i = 0; i < scene.width; ++i)
+
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int tilesY = (scene.height + tileSize - 1) / tileSize;
+    int numTiles = tilesX * tilesY;
+    std::atomic<int> tilesDone(0);
+    pool.ParallelFor(numTiles, [&](int tile) {
+        int x0 = (tile % tilesX) * tileSize, x1 = std::min(x0 + tileSize, scene.width);
+        int y0 = (tile / tilesX) * tileSize, y1 = std::min(y0 + tileSize, scene.height);
+        for (int j = y0; j < y1; ++j)
         {
-            // generate primary ray direction
-            float x;
-            float y;
-            // TODO: Find the x and y positions of the current pixel to get the direction
-            // vector that passes through it.
-            // Also, don't forget to multiply both of them with the variable *scale*, and
-            // x (horizontal) variable with the *imageAspectRatio*            
-            x = (2.0f * (i+0.5f)/(float)(scene.width-1.0f) -1.0f)* scale * imageAspectRatio;
-            y = -(2.0f * (j+0.5f)/(float)(scene.height-1.0f) -1.0f) * scale;
+            for (int i = x0; i < x1; ++i)
+            {
+                // generate primary ray direction
+                float x;
+                float y;
+                // TODO: Find the x and y positions of the current pixel to get the direction
+                // vector that passes through it.
+                // Also, don't forget to multiply both of them with the variable *scale*, and
+                // x (horizontal) variable with the *imageAspectRatio*
+                x = (2.0f * (i+0.5f)/(float)(scene.width-1.0f) -1.0f)* scale * imageAspectRatio;
+                y = -(2.0f * (j+0.5f)/(float)(scene.height-1.0f) -1.0f) * scale;
 
-            Vector3f dir = normalize(Vector3f(x, y, -1.0f)); // Don't forget to normalize this direction!
-            framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
+                Vector3f dir = normalize(Vector3f(x, y, -1.0f)); // Don't forget to normalize this direction!
+                framebuffer[j * scene.width + i] = castRay(eye_pos, dir, scene, 0);
+            }
         }
-        UpdateProgress(j / (float)scene.height);
-    }
+        tilesDone.fetch_add(1, std::memory_order_relaxed);
+    });
+    while (!pool.WaitFor(std::chrono::milliseconds(100)))
+        UpdateProgress(tilesDone.load(std::memory_order_relaxed) / (float)numTiles);
+    UpdateProgress(1.f);
 
     // save framebuffer to file
     FILE* fp = fopen("binary.ppm", "wb");
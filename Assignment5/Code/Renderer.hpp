@@ -1,5 +1,6 @@
 #pragma once
 #include "Scene.hpp"
+#include "ThreadPool.hpp"
 
 struct hit_payload
 {
@@ -14,5 +15,9 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // the image is rendered in square tiles of this many pixels
+    int tileSize = 32;
+
 private:
+    ThreadPool pool;
 };
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
+#include "Grid.hpp"
 
 class Scene
 {
@@ -16,6 +17,12 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 5;
     float epsilon = 0.00001;
+    // reflection/refraction rays whose weight in the pixel (product of the
+    // Fresnel factors on the way) falls below this are not traced
+    float minWeight = 1.0f / 255;
+    // follow only one of reflection and refraction, chosen with probability
+    // kr and 1 - kr, instead of both
+    bool stochasticFresnel = false;
     //float epsilon = 0.01f;
 
     Scene(int w, int h) : width(w), height(h)
@@ -27,8 +34,14 @@ public:
     [[nodiscard]] const std::vector<std::unique_ptr<Object> >& get_objects() const { return objects; }
     [[nodiscard]] const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
 
+    // Put all objects into a uniform grid; trace() walks it instead of testing
+    // every object. Objects added afterwards need another call.
+    void buildGrid() { grid = std::make_unique<Grid>(objects); }
+    [[nodiscard]] const Grid* get_grid() const { return grid.get(); }
+
 private:
     // creating the scene (adding objects and lights)
     std::vector<std::unique_ptr<Object> > objects;
     std::vector<std::unique_ptr<Light> > lights;
+    std::unique_ptr<Grid> grid;
 };
\ No newline at end of file
@@ -37,6 +37,12 @@ public:
         N = normalize(P - center);
     }
 
+    void getPrimitiveBounds(uint32_t, Vector3f& pMin, Vector3f& pMax) const override
+    {
+        pMin = center - Vector3f(radius);
+        pMax = center + Vector3f(radius);
+    }
+
     Vector3f center;
     float radius, radius2;
 };
@@ -73,6 +73,36 @@ public:
         return intersect;
     }
 
+    uint32_t getPrimitiveCount() const override
+    {
+        return numTriangles;
+    }
+
+    void getPrimitiveBounds(uint32_t prim, Vector3f& pMin, Vector3f& pMax) const override
+    {
+        const Vector3f& v0 = vertices[vertexIndex[prim * 3]];
+        const Vector3f& v1 = vertices[vertexIndex[prim * 3 + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[prim * 3 + 2]];
+        pMin = Vector3f::Min(v0, Vector3f::Min(v1, v2));
+        pMax = Vector3f::Max(v0, Vector3f::Max(v1, v2));
+    }
+
+    bool intersectPrimitive(uint32_t prim, const Vector3f& orig, const Vector3f& dir, float& tnear, uint32_t& index,
+                            Vector2f& uv) const override
+    {
+        const Vector3f& v0 = vertices[vertexIndex[prim * 3]];
+        const Vector3f& v1 = vertices[vertexIndex[prim * 3 + 1]];
+        const Vector3f& v2 = vertices[vertexIndex[prim * 3 + 2]];
+        float t, u, v;
+        if (!rayTriangleIntersect(v0, v1, v2, orig, dir, t, u, v))
+            return false;
+        tnear = t;
+        uv.x = u;
+        uv.y = v;
+        index = prim;
+        return true;
+    }
+
     void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t& index, const Vector2f& uv, Vector3f& N,
                               Vector2f& st) const override
     {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
@@ -66,6 +67,18 @@ public:
     {
         return os << v.x << ", " << v.y << ", " << v.z;
     }
+    float operator[](int index) const
+    {
+        return index == 0 ? x : (index == 1 ? y : z);
+    }
+    static Vector3f Min(const Vector3f& p1, const Vector3f& p2)
+    {
+        return Vector3f(std::min(p1.x, p2.x), std::min(p1.y, p2.y), std::min(p1.z, p2.z));
+    }
+    static Vector3f Max(const Vector3f& p1, const Vector3f& p2)
+    {
+        return Vector3f(std::max(p1.x, p2.x), std::max(p1.y, p2.y), std::max(p1.z, p2.z));
+    }
     float x, y, z;
 };
 
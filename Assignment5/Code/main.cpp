@@ -3,14 +3,28 @@
 #include "Triangle.hpp"
 #include "Light.hpp"
 #include "Renderer.hpp"
+#include <cstring>
+#include <iostream>
 
 // In the main function of the program, we create the scene (create objects and lights)
 // as well as set the options for the render (image width and height, maximum recursion
 // depth, field-of-view, etc.). We then call the render function().
-int main()
+int main(int argc, char** argv)
 {
     Scene scene(1280, 960);
 
+    // --stochastic-fresnel  follow only one of reflection and refraction per hit,
+    //                       picked by the Fresnel factor, instead of both
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--stochastic-fresnel"))
+            scene.stochasticFresnel = true;
+        else {
+            std::cerr << "unknown option " << argv[i] << "\n"
+                      << "usage: " << argv[0] << " [--stochastic-fresnel]\n";
+            return 1;
+        }
+    }
+
     auto sph1 = std::make_unique<Sphere>(Vector3f(-1, 0, -12), 2);
     sph1->materialType = DIFFUSE_AND_GLOSSY;
     sph1->diffuseColor = Vector3f(0.6, 0.7, 0.8);
@@ -32,6 +46,8 @@ int main()
     scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
     scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));    
 
+    scene.buildGrid();
+
     Renderer r;
     r.Render(scene);
 
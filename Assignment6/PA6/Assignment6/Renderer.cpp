@@ -14,6 +14,11 @@ const float EPSILON = 0.00001;
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
+//
+// Tiles of the image go to the pool's workers one at a time. Pixels don't
+// depend on each other, so the image does not change with the thread count.
+// Workers only bump an atomic tile count, which this thread turns into the
+// progress bar.
 void Renderer::Render(const Scene& scene)
 {
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
@@ -21,25 +26,36 @@ void Renderer::Render(const Scene& scene)
     float scale = tan(deg2rad(scene.fov * 0.5));
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(-1, 5, 10);
-    int m = 0;
-    for (uint32_t j = 0; j < scene.height; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-            // TODO: Find the x and y positions of the current pixel to get the
-            // direction
-            //  vector that passes through it.
-            // Also, don't forget to multiply both of them with the variable
-            // *scale*, and x (horizontal) variable with the *imageAspectRatio*
-            Vector3f dir = normalize(Vector3f(x,y,-1.0f));
-            framebuffer[m++] = scene.castRay(Ray(eye_pos,dir),0);
-            // Don't forget to normalize this direction!
 
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int tilesY = (scene.height + tileSize - 1) / tileSize;
+    int numTiles = tilesX * tilesY;
+    std::atomic<int> tilesDone(0);
+    pool.ParallelFor(numTiles, [&](int tile) {
+        uint32_t x0 = (tile % tilesX) * tileSize;
+        uint32_t y0 = (tile / tilesX) * tileSize;
+        uint32_t x1 = std::min<uint32_t>(x0 + tileSize, scene.width);
+        uint32_t y1 = std::min<uint32_t>(y0 + tileSize, scene.height);
+        for (uint32_t j = y0; j < y1; ++j) {
+            for (uint32_t i = x0; i < x1; ++i) {
+                // generate primary ray direction
+                float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+                          imageAspectRatio * scale;
+                float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+                // TODO: Find the x and y positions of the current pixel to get the
+                // direction
+                //  vector that passes through it.
+                // Also, don't forget to multiply both of them with the variable
+                // *scale*, and x (horizontal) variable with the *imageAspectRatio*
+                Vector3f dir = normalize(Vector3f(x,y,-1.0f));
+                framebuffer[j * scene.width + i] = scene.castRay(Ray(eye_pos,dir),0);
+                // Don't forget to normalize this direction!
+            }
         }
-        UpdateProgress(j / (float)scene.height);
-    }
+        tilesDone.fetch_add(1, std::memory_order_relaxed);
+    });
+    while (!pool.WaitFor(std::chrono::milliseconds(100)))
+        UpdateProgress(tilesDone.load(std::memory_order_relaxed) / (float)numTiles);
     UpdateProgress(1.f);
 
     // save framebuffer to file
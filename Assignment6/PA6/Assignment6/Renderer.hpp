@@ -2,6 +2,7 @@
 // Created by goksu on 2/25/20.
 //
 #include "Scene.hpp"
+#include "ThreadPool.hpp"
 
 #pragma once
 struct hit_payload
@@ -17,5 +18,9 @@ class Renderer
 public:
     void Render(const Scene& scene);
 
+    // the image is rendered in square tiles of this many pixels
+    int tileSize = 32;
+
 private:
+    ThreadPool pool;
 };
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that stay alive between renders and run
+// whatever jobs are submitted to them.
+class ThreadPool
+{
+public:
+    // threads <= 0: one per hardware thread
+    explicit ThreadPool(int threads = 0)
+    {
+        if (threads <= 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < threads; ++i)
+            workers.emplace_back([this] { WorkerLoop(); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    int Size() const { return (int)workers.size(); }
+
+    void Submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+            ++pending;
+        }
+        wake.notify_one();
+    }
+
+    // Run func(i) for every i in [0, n) on all workers. Indices are handed out
+    // in increasing order from a shared counter, so with i numbering image
+    // tiles the workers take the next free tile whenever they finish one.
+    // Returns at once; Wait or WaitFor for the end.
+    void ParallelFor(int n, std::function<void(int)> func)
+    {
+        auto next = std::make_shared<std::atomic<int> >(0);
+        auto body = std::make_shared<std::function<void(int)> >(std::move(func));
+        for (int t = 0; t < std::min(n, Size()); ++t)
+            Submit([=] {
+                for (int i = (*next)++; i < n; i = (*next)++)
+                    (*body)(i);
+            });
+    }
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+    }
+
+    // false if jobs are still running after timeout
+    template <typename Rep, typename Period>
+    bool WaitFor(const std::chrono::duration<Rep, Period>& timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        return idle.wait_for(lock, timeout, [this] { return pending == 0; });
+    }
+
+private:
+    void WorkerLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            std::function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+            if (--pending == 0)
+                idle.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > jobs;
+    // jobs submitted but not finished
+    int pending = 0;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable wake, idle;
+};
@@ -1,110 +1,522 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <thread>
 #include "BVH.hpp"
+#include "Morton.hpp"
+
+// Split [0, n) into one contiguous chunk per hardware thread and run
+// func(chunk, begin, end) on each. Small ranges stay on the calling thread.
+template <typename F>
+static void ParallelChunks(size_t n, int nChunks, F func)
+{
+    if (nChunks <= 1) {
+        func(0, 0, n);
+        return;
+    }
+    std::vector<std::thread> th;
+    for (int c = 0; c < nChunks; ++c)
+        th.emplace_back(func, c, n * c / nChunks, n * (c + 1) / nChunks);
+    for (auto& t : th)
+        t.join();
+}
+
+static int ChunkCount(size_t n)
+{
+    if (n < 16384)
+        return 1;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Stable LSD radix sort of (key, value) pairs, 11 bits per pass. Every thread
+// counts the digits of its own chunk, so the scatter of a pass only needs a
+// prefix sum over (digit, chunk) and no synchronization.
+static void RadixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values,
+                      int keyBits)
+{
+    size_t n = keys.size();
+    int nChunks = ChunkCount(n);
+    std::vector<uint64_t> tmpKeys(n);
+    std::vector<uint32_t> tmpValues(n);
+    constexpr int digitBits = 11, digits = 1 << digitBits;
+    std::vector<std::array<size_t, digits>> offsets(nChunks);
+
+    for (int shift = 0; shift < keyBits; shift += digitBits) {
+        ParallelChunks(n, nChunks, [&](int c, size_t b, size_t e) {
+            offsets[c].fill(0);
+            for (size_t i = b; i < e; ++i)
+                ++offsets[c][(keys[i] >> shift) & (digits - 1)];
+        });
+        size_t sum = 0;
+        bool trivial = false;
+        for (int d = 0; d < digits; ++d)
+            for (int c = 0; c < nChunks; ++c) {
+                size_t count = offsets[c][d];
+                trivial |= count == n;
+                offsets[c][d] = sum;
+                sum += count;
+            }
+        // every key has the same digit here, nothing would move
+        if (trivial)
+            continue;
+        ParallelChunks(n, nChunks, [&](int c, size_t b, size_t e) {
+            auto& offset = offsets[c];
+            for (size_t i = b; i < e; ++i) {
+                size_t dst = offset[(keys[i] >> shift) & (digits - 1)]++;
+                tmpKeys[dst] = keys[i];
+                tmpValues[dst] = values[i];
+            }
+        });
+        keys.swap(tmpKeys);
+        values.swap(tmpValues);
+    }
+}
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
-                   SplitMethod splitMethod)
+                   SplitMethod splitMethod, int lazyBuildDepth, bool compressNodes)
     : maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod),
+      lazyBuildDepth(lazyBuildDepth),
       primitives(std::move(p))
 {
-    time_t start, stop;
-    time(&start);
+    auto start = std::chrono::steady_clock::now();
     if (primitives.empty())
         return;
 
-    root = recursiveBuild(primitives);
+    if (splitMethod == SplitMethod::LBVH)
+        root = buildLBVH();
+    else
+        root = recursiveBuild(0, (int)primitives.size(), 0);
+    if (compressNodes)
+        compress();
 
-    time(&stop);
-    double diff = difftime(stop, start);
+    double diff = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     int hrs = (int)diff / 3600;
     int mins = ((int)diff / 60) - (hrs * 60);
-    int secs = (int)diff - (hrs * 3600) - (mins * 60);
+    double secs = diff - (hrs * 3600) - (mins * 60);
 
     printf(
-        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n",
+        "\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %.3f secs\n\n",
         hrs, mins, secs);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHAccel::~BVHAccel()
 {
-    BVHBuildNode* node = new BVHBuildNode();
+    // the nodes are released together with the arena
+}
+
+BVHBuildNode* BVHAccel::allocNode() const
+{
+    std::lock_guard<std::mutex> guard(arenaMutex);
+    return arena.Alloc<BVHBuildNode>();
+}
 
-    // Compute bounds of all primitives in BVH node
-    Bounds3 bounds;
-    for (int i = 0; i < objects.size(); ++i)
-        bounds = Union(bounds, objects[i]->getBounds());
-    if (objects.size() == 1) {
+// Build the subtree over primitives[start, end). The range is reordered in
+// place; below lazyBuildDepth a node only records its range, bounds and area
+// and is split the first time a traversal reaches it (see expand).
+BVHBuildNode* BVHAccel::recursiveBuild(int start, int end, int depth) const
+{
+    BVHBuildNode* node = allocNode();
+    if (lazyBuildDepth >= 0 && depth >= lazyBuildDepth && end - start > 2) {
+        // Compute bounds of all primitives in BVH node
+        node->area = 0;
+        for (int i = start; i < end; ++i) {
+            node->bounds = Union(node->bounds, primitives[i]->getBounds());
+            node->area += primitives[i]->getArea();
+        }
+        node->lazy = true;
+        node->firstPrimOffset = start;
+        node->nPrimitives = end - start;
+        return node;
+    }
+    buildNode(node, start, end, depth);
+    return node;
+}
+
+void BVHAccel::buildNode(BVHBuildNode* node, int start, int end, int depth) const
+{
+    Object** objects = primitives.data();
+    if (end - start == 1) {
         // Create leaf _BVHBuildNode_
-        node->bounds = objects[0]->getBounds();
-        node->object = objects[0];
+        node->bounds = objects[start]->getBounds();
+        node->object = objects[start];
         node->left = nullptr;
         node->right = nullptr;
-        node->area = objects[0]->getArea();
-        return node;
+        node->area = objects[start]->getArea();
+        return;
     }
-    else if (objects.size() == 2) {
-        node->left = recursiveBuild(std::vector{objects[0]});
-        node->right = recursiveBuild(std::vector{objects[1]});
-
-        node->bounds = Union(node->left->bounds, node->right->bounds);
-        node->area = node->left->area + node->right->area;
-        return node;
+    else if (end - start == 2) {
+        node->left = recursiveBuild(start, start + 1, depth + 1);
+        node->right = recursiveBuild(start + 1, end, depth + 1);
     }
     else {
         Bounds3 centroidBounds;
-        for (int i = 0; i < objects.size(); ++i)
+        for (int i = start; i < end; ++i)
             centroidBounds =
                 Union(centroidBounds, objects[i]->getBounds().Centroid());
         int dim = centroidBounds.maxExtent();
         switch (dim) {
         case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
+            std::sort(objects + start, objects + end, [](auto f1, auto f2) {
                 return f1->getBounds().Centroid().x <
                        f2->getBounds().Centroid().x;
             });
             break;
         case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
+            std::sort(objects + start, objects + end, [](auto f1, auto f2) {
                 return f1->getBounds().Centroid().y <
                        f2->getBounds().Centroid().y;
             });
             break;
         case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
+            std::sort(objects + start, objects + end, [](auto f1, auto f2) {
                 return f1->getBounds().Centroid().z <
                        f2->getBounds().Centroid().z;
             });
             break;
         }
 
-        auto beginning = objects.begin();
-        auto middling = objects.begin() + (objects.size() / 2);
-        auto ending = objects.end();
+        int middling = start + (end - start) / 2;
 
-        auto leftshapes = std::vector<Object*>(beginning, middling);
-        auto rightshapes = std::vector<Object*>(middling, ending);
-
-        assert(objects.size() == (leftshapes.size() + rightshapes.size()));
-
-        node->left = recursiveBuild(leftshapes);
-        node->right = recursiveBuild(rightshapes);
+        node->left = recursiveBuild(start, middling, depth + 1);
+        node->right = recursiveBuild(middling, end, depth + 1);
+    }
 
+    // a lazy node already has these, and other threads may be reading them
+    if (!node->lazy) {
         node->bounds = Union(node->left->bounds, node->right->bounds);
         node->area = node->left->area + node->right->area;   // 算该bvh所套住的整个物体的表面积
     }
+}
 
-    return node;
+// Split a lazy node on first use. Only its own primitive range is touched,
+// so different threads can expand different nodes at the same time; the
+// once_flag makes the others wait until the children are complete.
+void BVHAccel::expand(BVHBuildNode* node) const
+{
+    std::call_once(node->expandOnce, [&]() {
+        buildNode(node, node->firstPrimOffset, node->firstPrimOffset + node->nPrimitives, 0);
+    });
+}
+
+// Linear BVH (Karras 2012, built bottom-up as in Apetrei, "Fast and Simple
+// Agglomerative LBVH Construction", 2014). The primitive centroids are sorted
+// along a Morton curve and internal node k splits the sorted leaves between
+// k and k+1. Every leaf walks up on its own: a node covering [left, right]
+// becomes a child of split `right` or split `left - 1`, whichever of the two
+// neighbouring codes shares the longer prefix with it. The first child to
+// arrive at a parent leaves its range bound there and stops; the second one
+// finishes the parent's bounds and keeps climbing, so hierarchy and bounds
+// come out of a single parallel pass without any searching.
+// All 2n-1 nodes come from one arena block: internal nodes first, then leaves.
+BVHBuildNode* BVHAccel::buildLBVH()
+{
+    const int n = (int)primitives.size();
+    const int nChunks = ChunkCount(n);
+    std::vector<Bounds3> primBounds(n);
+    std::vector<float> primArea(n);
+    std::vector<Bounds3> chunkBounds(nChunks);
+    ParallelChunks(n, nChunks, [&](int c, size_t b, size_t e) {
+        Bounds3 centroidBounds;
+        for (size_t i = b; i < e; ++i) {
+            primBounds[i] = primitives[i]->getBounds();
+            primArea[i] = primitives[i]->getArea();
+            centroidBounds = Union(centroidBounds, primBounds[i].Centroid());
+        }
+        chunkBounds[c] = centroidBounds;
+    });
+    Bounds3 centroidBounds;
+    for (auto& b : chunkBounds)
+        centroidBounds = Union(centroidBounds, b);
+
+    // 30-bit codes are enough up to about a million primitives and sort in
+    // half the passes; denser meshes need the 63-bit ones to stay apart
+    const int keyBits = n > (1 << 20) ? 63 : 30;
+    std::vector<uint64_t> codes(n);
+    std::vector<uint32_t> order(n);
+    ParallelChunks(n, nChunks, [&](int, size_t b, size_t e) {
+        for (size_t i = b; i < e; ++i) {
+            Vector3f p = centroidBounds.Offset(primBounds[i].Centroid());
+            codes[i] = keyBits == 30 ? EncodeMorton3(p) : EncodeMorton63(p);
+            order[i] = (uint32_t)i;
+        }
+    });
+    RadixSort(codes, order, keyBits);
+
+    BVHBuildNode* nodes = static_cast<BVHBuildNode*>(arena.Alloc(sizeof(BVHBuildNode) * (2 * n - 1)));
+    BVHBuildNode* internal = nodes;
+    BVHBuildNode* leaves = nodes + (n - 1);
+    if (n == 1) {
+        new (leaves) BVHBuildNode();
+        leaves->bounds = primBounds[0];
+        leaves->object = primitives[0];
+        leaves->area = primArea[0];
+        return leaves;
+    }
+
+    // how far apart sorted leaves i and i+1 are; equal codes are told apart
+    // by their position, as if the index were appended to the code
+    auto delta = [&](int i) {
+        return std::make_pair(codes[i] ^ codes[i + 1], (uint32_t)(i ^ (i + 1)));
+    };
+
+    std::unique_ptr<std::atomic<int>[]> otherBound(new std::atomic<int>[n - 1]);
+    ParallelChunks(n - 1, nChunks, [&](int, size_t b, size_t e) {
+        for (size_t i = b; i < e; ++i) {
+            new (&internal[i]) BVHBuildNode();
+            otherBound[i].store(-1, std::memory_order_relaxed);
+        }
+    });
+    std::atomic<BVHBuildNode*> root{nullptr};
+    ParallelChunks(n, nChunks, [&](int, size_t b, size_t e) {
+        for (int i = (int)b; i < (int)e; ++i) {
+            BVHBuildNode* current = new (&leaves[i]) BVHBuildNode();
+            current->bounds = primBounds[order[i]];
+            current->object = primitives[order[i]];
+            current->area = primArea[order[i]];
+
+            int left = i, right = i;
+            while (true) {
+                int parent, previous;
+                if (left == 0 || (right != n - 1 && delta(right) < delta(left - 1))) {
+                    parent = right;
+                    internal[parent].left = current;
+                    previous = otherBound[parent].exchange(left, std::memory_order_acq_rel);
+                    if (previous != -1)
+                        right = previous;
+                }
+                else {
+                    parent = left - 1;
+                    internal[parent].right = current;
+                    previous = otherBound[parent].exchange(right, std::memory_order_acq_rel);
+                    if (previous != -1)
+                        left = previous;
+                }
+                // the first child to get here leaves the work to the second
+                if (previous == -1)
+                    break;
+                current = &internal[parent];
+                current->bounds = Union(current->left->bounds, current->right->bounds);
+                current->area = current->left->area + current->right->area;
+                if (left == 0 && right == n - 1) {
+                    root = current;
+                    break;
+                }
+            }
+        }
+    });
+    return root;
+}
+
+// 2^e as a float, built from the exponent bits
+static inline float Pow2(int e)
+{
+    uint32_t bits = (uint32_t)(e + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Quantize the children's boxes inside box. The scale of every axis is the
+// smallest power of two that fits the box into 255 steps; values are then
+// stepped outwards until the decoded float box covers the real one.
+static void QuantizeChildren(CompressedBVHNode& node, const Bounds3& box,
+                             const Bounds3* childBounds, int count)
+{
+    for (int a = 0; a < 3; ++a) {
+        float o = box.pMin[a];
+        float extent = box.pMax[a] - o;
+        int e = -126;
+        if (extent > 0) {
+            std::frexp(extent / 255.0f, &e);
+            e = std::max(e, -126);
+        }
+        while (o + 255 * Pow2(e) < box.pMax[a])
+            ++e;
+        float scale = Pow2(e);
+        node.origin[a] = o;
+        node.exp[a] = (int8_t)e;
+        for (int c = 0; c < 4; ++c) {
+            if (c >= count) {
+                node.lo[a][c] = node.hi[a][c] = 0;
+                continue;
+            }
+            float cmin = childBounds[c].pMin[a], cmax = childBounds[c].pMax[a];
+            int qlo = (int)clamp(0.f, 255.f, std::floor((cmin - o) / scale));
+            int qhi = (int)clamp(0.f, 255.f, std::ceil((cmax - o) / scale));
+            while (qlo > 0 && o + qlo * scale > cmin)
+                --qlo;
+            while (qhi < 255 && o + qhi * scale < cmax)
+                ++qhi;
+            node.lo[a][c] = (uint8_t)qlo;
+            node.hi[a][c] = (uint8_t)qhi;
+        }
+    }
+    node.count = (uint8_t)count;
+}
+
+// Pull up to four children into one wide node by opening the interior child
+// with the largest surface area until there are four of them. Leaves go to
+// prims in the order they are met, so neighbouring leaves stay close.
+uint32_t BVHAccel::collapse(BVHBuildNode* node, std::vector<Object*>& prims,
+                            std::vector<float>& areas, int depth)
+{
+    compressedDepth = std::max(compressedDepth, depth);
+    auto open = [&](BVHBuildNode* n) {
+        if (n->lazy)
+            expand(n);
+        return n->left != nullptr && n->right != nullptr;
+    };
+    BVHBuildNode* children[4] = {node};
+    int count = 1;
+    if (open(node)) {
+        children[0] = node->left;
+        children[1] = node->right;
+        count = 2;
+        while (count < 4) {
+            int best = -1;
+            double bestArea = -1;
+            for (int i = 0; i < count; ++i) {
+                if (open(children[i]) && children[i]->bounds.SurfaceArea() > bestArea) {
+                    best = i;
+                    bestArea = children[i]->bounds.SurfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+            BVHBuildNode* n = children[best];
+            children[best] = n->left;
+            children[count++] = n->right;
+        }
+    }
+
+    uint32_t index = (uint32_t)compressedNodes.size();
+    compressedNodes.emplace_back();
+    Bounds3 childBounds[4];
+    uint32_t childRef[4] = {0, 0, 0, 0};
+    for (int i = 0; i < count; ++i) {
+        childBounds[i] = children[i]->bounds;
+        if (!open(children[i])) {
+            childRef[i] = CompressedBVHNode::LeafFlag | (uint32_t)prims.size();
+            prims.push_back(children[i]->object);
+            areas.push_back(children[i]->area);
+        }
+        else
+            childRef[i] = collapse(children[i], prims, areas, depth + 1);
+    }
+    // the vector may have grown while the children were collapsed
+    CompressedBVHNode& wide = compressedNodes[index];
+    QuantizeChildren(wide, node->bounds, childBounds, count);
+    for (int i = 0; i < 4; ++i)
+        wide.child[i] = childRef[i];
+    return index;
+}
+
+void BVHAccel::compress()
+{
+    std::vector<Object*> prims;
+    std::vector<float> areas;
+    collapse(root, prims, areas, 1);
+    // one primitive per leaf, so the binary tree had 2n - 1 nodes
+    size_t binaryNodes = 2 * prims.size() - 1;
+
+    primitives.swap(prims);
+    primAreaSum.resize(areas.size());
+    float sum = 0;
+    for (size_t i = 0; i < areas.size(); ++i)
+        primAreaSum[i] = sum += areas[i];
+    compressedBound = root->bounds;
+
+    printf("BVH compressed: %zu nodes (%zu bytes) -> %zu wide nodes (%zu bytes)\n",
+           binaryNodes, binaryNodes * sizeof(BVHBuildNode),
+           compressedNodes.size(), compressedNodes.size() * sizeof(CompressedBVHNode));
+    root = nullptr;
+    arena.Reset();
+}
+
+Bounds3 BVHAccel::WorldBound() const
+{
+    if (!compressedNodes.empty())
+        return compressedBound;
+    return root ? root->bounds : Bounds3();
 }
 
 Intersection BVHAccel::Intersect(const Ray& ray) const
 {
     Intersection isect;
+    if (!compressedNodes.empty())
+        return intersectCompressed(ray);
     if (!root)
         return isect;
     isect = BVHAccel::getIntersection(root, ray);
     return isect;
 }
 
+// Stack traversal of the compressed tree. All four child boxes of a node are
+// decoded and slab-tested together; hit children are visited nearest first
+// and skipped once they start behind the closest hit found so far.
+Intersection BVHAccel::intersectCompressed(const Ray& ray) const
+{
+    Intersection isect;
+    const float o[3] = {ray.origin.x, ray.origin.y, ray.origin.z};
+    const float inv[3] = {1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z};
+
+    struct Entry { uint32_t ref; float t; };
+    // deep trees (e.g. an LBVH over clustered Morton codes) get a heap stack
+    Entry localStack[256];
+    std::vector<Entry> heapStack;
+    Entry* stack = localStack;
+    size_t stackSize = 3 * (size_t)compressedDepth + 1;
+    if (stackSize > 256) {
+        heapStack.resize(stackSize);
+        stack = heapStack.data();
+    }
+    int sp = 0;
+    stack[sp++] = {0, 0};
+    while (sp > 0) {
+        Entry entry = stack[--sp];
+        if (entry.t > isect.distance)
+            continue;
+        if (entry.ref & CompressedBVHNode::LeafFlag) {
+            Intersection hit = primitives[entry.ref & ~CompressedBVHNode::LeafFlag]->getIntersection(ray);
+            if (hit.distance < isect.distance)
+                isect = hit;
+            continue;
+        }
+        const CompressedBVHNode& node = compressedNodes[entry.ref];
+        float tEnter[4], tExit[4];
+        for (int c = 0; c < 4; ++c) {
+            tEnter[c] = -kInfinity;
+            tExit[c] = kInfinity;
+        }
+        for (int a = 0; a < 3; ++a) {
+            float scale = Pow2(node.exp[a]);
+            for (int c = 0; c < 4; ++c) {
+                float t0 = (node.origin[a] + node.lo[a][c] * scale - o[a]) * inv[a];
+                float t1 = (node.origin[a] + node.hi[a][c] * scale - o[a]) * inv[a];
+                tEnter[c] = std::max(tEnter[c], std::min(t0, t1));
+                tExit[c] = std::min(tExit[c], std::max(t0, t1));
+            }
+        }
+        // push the far children first so the nearest one is popped next
+        Entry hits[4];
+        int nHits = 0;
+        for (int c = 0; c < node.count; ++c) {
+            if (tEnter[c] <= tExit[c] && tExit[c] >= 0 && tEnter[c] < isect.distance) {
+                int k = nHits++;
+                for (; k > 0 && hits[k - 1].t < tEnter[c]; --k)
+                    hits[k] = hits[k - 1];
+                hits[k] = {node.child[c], tEnter[c]};
+            }
+        }
+        for (int k = 0; k < nHits; ++k)
+            stack[sp++] = hits[k];
+    }
+    return isect;
+}
+
 Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
 {
     // TODO Traverse the BVH to find intersection
@@ -120,6 +532,8 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
     //没有交点
     if(!node -> bounds.IntersectP(ray, invdir, dirIsNeg))
         return inter;
+    if(node -> lazy)
+        expand(node);
     //有交点，且该点为叶子节点，去和三角形求交
     if(node -> left == nullptr && node -> right == nullptr)
         return node -> object -> getIntersection(ray);
@@ -130,8 +544,49 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
 
 }
 
+void BVHAccel::IntersectPacket(RayPacket& packet) const
+{
+    // the compressed tree has no packet kernel: trace the rays one by one
+    if (!compressedNodes.empty()) {
+        for (int i = 0; i < packet.size; ++i) {
+            Intersection inter = intersectCompressed(packet.GetRay(i));
+            if (inter.happened && inter.distance < packet.tHit[i]) {
+                packet.hit[i] = inter;
+                packet.tHit[i] = inter.distance;
+            }
+        }
+        return;
+    }
+    if (!root)
+        return;
+    getIntersectionPacket(root, packet);
+}
+
+// Packet traversal: a node is skipped when it is outside the packet frustum
+// or when no ray of the packet can reach it before its current closest hit.
+// The child nearer to the camera along the packet axis is visited first so
+// that tHit shrinks early and culls more of the far child.
+void BVHAccel::getIntersectionPacket(BVHBuildNode* node, RayPacket& packet) const
+{
+    if (packet.Culled(node->bounds) || !packet.IntersectP(node->bounds))
+        return;
+    if (node->lazy)
+        expand(node);
+    if (node->left == nullptr && node->right == nullptr) {
+        node->object->getIntersectionPacket(packet);
+        return;
+    }
+    float dl = dotProduct(node->left->bounds.Centroid() - packet.origin, packet.center);
+    float dr = dotProduct(node->right->bounds.Centroid() - packet.origin, packet.center);
+    BVHBuildNode* first = dl <= dr ? node->left : node->right;
+    BVHBuildNode* second = dl <= dr ? node->right : node->left;
+    getIntersectionPacket(first, packet);
+    getIntersectionPacket(second, packet);
+}
 
 void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
+    if(node->lazy)
+        expand(node);
     if(node->left == nullptr || node->right == nullptr){
         node->object->Sample(pos, pdf); // 获取pos.coords , pos.normal , pdf
         pdf *= node->area;  // 按道理来说，这时候的pdf应该是1
@@ -142,6 +597,17 @@ void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &
 }
 
 void BVHAccel::Sample(Intersection &pos, float &pdf){
+    if (!compressedNodes.empty()) {
+        // same choice as getSample: the first primitive whose running area sum exceeds p
+        float total = primAreaSum.back();
+        float p = std::sqrt(get_random_float()) * total;
+        size_t i = std::upper_bound(primAreaSum.begin(), primAreaSum.end(), p) - primAreaSum.begin();
+        i = std::min(i, primAreaSum.size() - 1);
+        primitives[i]->Sample(pos, pdf);
+        pdf *= primitives[i]->getArea();
+        pdf /= total;
+        return;
+    }
     float p = std::sqrt(get_random_float()) * root->area; // 从这个object的大面积范围内随机一个面积点
     getSample(root, p, pos, pdf);
     pdf /= root->area;          // 1.0f/root->area
@@ -8,14 +8,18 @@
 #include <atomic>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <ctime>
 #include "Object.hpp"
 #include "Ray.hpp"
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
+#include "RayPacket.hpp"
 #include "Vector.hpp"
+#include "MemoryArena.hpp"
 
 struct BVHBuildNode;
+struct CompressedBVHNode;
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
@@ -25,25 +29,60 @@ class BVHAccel {
 
 public:
     // BVHAccel Public Types
-    enum class SplitMethod { NAIVE, SAH };
+    // LBVH: linear BVH from Morton-sorted centroids, see buildLBVH
+    enum class SplitMethod { NAIVE, SAH, LBVH };
 
     // BVHAccel Public Methods
-    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+    // lazyBuildDepth: levels of the recursive (NAIVE) build done up front;
+    // nodes below are split the first time a ray or a light sample reaches
+    // them. Negative builds the whole tree at once.
+    // compressNodes: store the finished tree as quantized 4-wide nodes. Needs
+    // the whole tree, so lazy nodes get expanded by the conversion.
+    BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE,
+             int lazyBuildDepth = -1, bool compressNodes = false);
     Bounds3 WorldBound() const;
     ~BVHAccel();
 
     Intersection Intersect(const Ray &ray) const;
+    Intersection intersectCompressed(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+    // Closest hits for a packet of rays sharing one origin
+    void IntersectPacket(RayPacket &packet) const;
+    void getIntersectionPacket(BVHBuildNode* node, RayPacket &packet) const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    BVHBuildNode* root = nullptr;
 
     // BVHAccel Private Methods
-    BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    BVHBuildNode* recursiveBuild(int start, int end, int depth) const;
+    void buildNode(BVHBuildNode* node, int start, int end, int depth) const;
+    void expand(BVHBuildNode* node) const;
+    BVHBuildNode* allocNode() const;
+    // Replace the binary tree by CompressedBVHNodes and free it
+    void compress();
+    uint32_t collapse(BVHBuildNode* node, std::vector<Object*>& prims,
+                      std::vector<float>& areas, int depth);
+    BVHBuildNode* buildLBVH();
+
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
     const SplitMethod splitMethod;
-    std::vector<Object*> primitives;
+    const int lazyBuildDepth;
+    // lazy nodes reorder their own range of primitives when they are expanded
+    mutable std::vector<Object*> primitives;
+    // every node of the tree lives here and goes away with the accelerator
+    mutable MemoryArena arena;
+    mutable std::mutex arenaMutex;
+
+    // Compressed form, used instead of root when not empty. Leaf children
+    // index primitives, which is put in leaf order; primAreaSum[i] is the
+    // area of primitives[0..i] for picking a light sample.
+    std::vector<CompressedBVHNode> compressedNodes;
+    std::vector<float> primAreaSum;
+    Bounds3 compressedBound;
+    // Wide levels of the compressed tree; a traversal holds at most three
+    // pending siblings per level plus the four children of the deepest node.
+    int compressedDepth = 0;
 
     void getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf);
     void Sample(Intersection &pos, float &pdf);
@@ -55,6 +94,9 @@ struct BVHBuildNode {
     BVHBuildNode *right;
     Object* object;
     float area;
+    // not split yet: covers primitives[firstPrimOffset, +nPrimitives)
+    bool lazy = false;
+    std::once_flag expandOnce;
 
 public:
     int splitAxis=0, firstPrimOffset=0, nPrimitives=0;
@@ -67,6 +109,21 @@ public:
 };
 
 
-
+// Four children per node, their boxes quantized to 8 bits per side inside
+// the node's own box: a child spans origin + lo * 2^exp .. origin + hi * 2^exp
+// on every axis. The quantized values are rounded outwards, so the decoded box
+// always contains the real one and traversal never misses a hit. 64 bytes
+// for four children, against 2 x 80 bytes for two levels of BVHBuildNode.
+struct alignas(64) CompressedBVHNode {
+    static constexpr uint32_t LeafFlag = 0x80000000u;
+
+    float origin[3];
+    int8_t exp[3];
+    uint8_t count;          // used child slots, the rest are empty
+    uint8_t lo[3][4];
+    uint8_t hi[3][4];
+    // index of the child node, or LeafFlag | index into primitives
+    uint32_t child[4];
+};
 
 #endif //RAYTRACING_BVH_H
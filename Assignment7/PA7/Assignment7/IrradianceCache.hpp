@@ -0,0 +1,159 @@
+//
+// Irradiance cache for diffuse interreflection (Ward et al., "A Ray Tracing
+// Solution for Diffuse Interreflection", 1988; gradients from Ward and
+// Heckbert, "Irradiance Gradients", 1992).
+//
+
+#ifndef RAYTRACING_IRRADIANCECACHE_H
+#define RAYTRACING_IRRADIANCECACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include "Vector.hpp"
+#include "global.hpp"
+#include "Bounds3.hpp"
+
+// Indirect irradiance at one surface point. rot[a] and trans[a] hold the
+// rotational and translational gradients along world axis a (one value per
+// color channel), so a nearby point p with normal n gets
+//     E + sum_a rot[a] * (normal x n)[a] + trans[a] * (p - position)[a]
+struct IrradianceRecord
+{
+    Vector3f position;
+    Vector3f normal;
+    Vector3f E;
+    // harmonic mean distance to the surfaces seen from here
+    float R;
+    Vector3f rot[3];
+    Vector3f trans[3];
+};
+
+// Records live in an octree over the scene. A record is stored in every node
+// its validity sphere overlaps, at the first level whose cells are no larger
+// than the sphere, so a lookup only checks the nodes on the way down to the
+// point. Lookups take a shared lock and run in parallel; adding a record
+// takes the lock exclusively.
+class IrradianceCache
+{
+public:
+    // Ward's a: larger values reuse records further away
+    float maxError = 0.3f;
+    // hemisphere samples per record, thetaSteps x phiSteps stratified
+    int thetaSteps = 8, phiSteps = 32;
+    // limits of R, so records are neither too dense nor too sparse
+    float minSpacing, maxSpacing;
+
+    explicit IrradianceCache(const Bounds3& sceneBounds)
+    {
+        Vector3f d = sceneBounds.Diagonal();
+        float size = std::max(d.x, std::max(d.y, d.z));
+        root.center = 0.5f * (sceneBounds.pMin + sceneBounds.pMax);
+        root.halfSize = 0.5f * size * 1.01f;
+        minSpacing = 0.005f * d.norm();
+        maxSpacing = 0.1f * d.norm();
+    }
+
+    // Weighted interpolation of the valid records around p (Ward's weight
+    // 1 / (|p - p_i| / R_i + sqrt(1 - n . n_i)) > 1 / a, records in front of
+    // p rejected). False if no record is close enough.
+    bool Lookup(const Vector3f& p, const Vector3f& n, Vector3f& E) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        Vector3f sum(0.0f);
+        float sumWeight = 0;
+        const Node* node = &root;
+        while (node) {
+            for (int index : node->records) {
+                const IrradianceRecord& r = records[index];
+                const Vector3f d = p - r.position;
+                float cosine = std::min(1.0f, dotProduct(n, r.normal));
+                float err = std::sqrt(dotProduct(d, d)) / r.R + std::sqrt(std::max(0.0f, 1 - cosine));
+                if (err >= maxError || cosine <= 0)
+                    continue;
+                // p is behind the record's point: it may see different things
+                if (dotProduct(d, 0.5f * (n + r.normal)) < -0.05f * r.R)
+                    continue;
+                float w = err > 0 ? 1 / err : 1e6f;
+                const Vector3f rotation = crossProduct(r.normal, n);
+                Vector3f e = r.E;
+                for (int a = 0; a < 3; ++a)
+                    e += r.rot[a] * rotation[a] + r.trans[a] * d[a];
+                sum += w * Vector3f::Max(e, Vector3f(0.0f));
+                sumWeight += w;
+            }
+            node = node->child[ChildIndex(*node, p)].get();
+        }
+        if (sumWeight <= 0)
+            return false;
+        E = sum / sumWeight;
+        return true;
+    }
+
+    void Add(IrradianceRecord r)
+    {
+        // Tabellion and Lamorlette: a record must not claim a region over
+        // which its own gradient would change it by more than itself
+        Vector3f grad(Luminance(r.trans[0]), Luminance(r.trans[1]), Luminance(r.trans[2]));
+        if (grad.norm() > 0)
+            r.R = std::min(r.R, Luminance(r.E) / grad.norm());
+        r.R = clamp(minSpacing, maxSpacing, r.R);
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        int index = (int)records.size();
+        records.push_back(r);
+        insert(root, index, r.position, maxError * r.R, 0);
+    }
+
+    size_t Size() const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return records.size();
+    }
+
+private:
+    struct Node
+    {
+        Vector3f center;
+        float halfSize = 0;
+        std::unique_ptr<Node> child[8];
+        std::vector<int> records;
+    };
+    static constexpr int maxDepth = 16;
+
+    static int ChildIndex(const Node& node, const Vector3f& p)
+    {
+        return (p.x > node.center.x) | ((p.y > node.center.y) << 1) | ((p.z > node.center.z) << 2);
+    }
+
+    void insert(Node& node, int index, const Vector3f& p, float radius, int depth)
+    {
+        if (node.halfSize <= radius || depth == maxDepth) {
+            node.records.push_back(index);
+            return;
+        }
+        float h = 0.5f * node.halfSize;
+        for (int c = 0; c < 8; ++c) {
+            Vector3f center = node.center + Vector3f(c & 1 ? h : -h, c & 2 ? h : -h, c & 4 ? h : -h);
+            // skip children the validity sphere's box does not reach
+            if (std::fabs(p.x - center.x) > h + radius || std::fabs(p.y - center.y) > h + radius ||
+                std::fabs(p.z - center.z) > h + radius)
+                continue;
+            if (!node.child[c]) {
+                node.child[c].reset(new Node());
+                node.child[c]->center = center;
+                node.child[c]->halfSize = h;
+            }
+            insert(*node.child[c], index, p, radius, depth + 1);
+        }
+    }
+
+    Node root;
+    std::vector<IrradianceRecord> records;
+    mutable std::shared_mutex mutex;
+};
+
+#endif // RAYTRACING_IRRADIANCECACHE_H
@@ -0,0 +1,198 @@
+//
+// Light hierarchy for picking one of many emitters by its estimated
+// contribution to a shading point (Conty Estevez and Kulla, "Importance
+// Sampling of Many Lights with Adaptive Tree Splitting", 2018).
+//
+
+#ifndef RAYTRACING_LIGHTBVH_H
+#define RAYTRACING_LIGHTBVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Vector.hpp"
+#include "global.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Object.hpp"
+
+// Bound on a set of directions: every direction is within theta of axis
+struct DirectionCone
+{
+    Vector3f axis = Vector3f(0, 0, 1);
+    float theta = M_PI;     // pi: any direction
+
+    static DirectionCone Union(DirectionCone a, DirectionCone b)
+    {
+        if (b.theta > a.theta)
+            std::swap(a, b);
+        float thetaD = std::acos(clamp(-1, 1, dotProduct(a.axis, b.axis)));
+        if (std::min<float>(thetaD + b.theta, M_PI) <= a.theta)
+            return a;
+        // the smallest cone around both: rotate a's axis towards b's
+        float thetaO = 0.5f * (a.theta + thetaD + b.theta);
+        if (thetaO >= M_PI)
+            return DirectionCone();
+        Vector3f k = crossProduct(a.axis, b.axis);
+        if (dotProduct(k, k) < 1e-12f)
+            return DirectionCone();
+        k = normalize(k);
+        float thetaR = thetaO - a.theta;
+        // Rodrigues' rotation of a.axis around k
+        Vector3f axis = a.axis * std::cos(thetaR) + crossProduct(k, a.axis) * std::sin(thetaR) +
+                        k * (dotProduct(k, a.axis) * (1 - std::cos(thetaR)));
+        return {normalize(axis), thetaO};
+    }
+};
+
+// Every node stores the bounds, total emitted power and normal cone of the
+// lights below it. Sampling walks from the root and picks a child with
+// probability proportional to its importance for the shading point, so the
+// light reached at the bottom comes with the product of those choices as
+// its probability.
+class LightBVH
+{
+public:
+    explicit LightBVH(const std::vector<Object*>& emitters)
+    {
+        for (Object* e : emitters) {
+            Light light;
+            light.object = e;
+            light.bounds = e->getBounds();
+            // one sample is enough for the emission of a diffuse emitter
+            Intersection pos;
+            float pdf;
+            e->Sample(pos, pdf);
+            e->getNormalCone(light.cone.axis, light.cone.theta);
+            light.power = Luminance(pos.emit) * e->getArea() * M_PI;
+            if (light.power > 0)
+                lights.push_back(light);
+        }
+        if (!lights.empty())
+            build(0, (int)lights.size());
+    }
+
+    bool Empty() const { return lights.empty(); }
+
+    // Pick a light for the shading point (p, n) and a point on it. pdf is
+    // per unit area of the light. False if no light can reach p.
+    bool Sample(const Vector3f& p, const Vector3f& n, Intersection& pos, float& pdf) const
+    {
+        if (lights.empty())
+            return false;
+        int index = 0;
+        float pmf = 1;
+        while (nodes[index].light < 0) {
+            const Node& node = nodes[index];
+            float il = Importance(p, n, nodes[index + 1]);
+            float ir = Importance(p, n, nodes[node.right]);
+            if (il + ir <= 0)
+                return false;
+            float pl = il / (il + ir);
+            if (get_random_float() < pl) {
+                index = index + 1;
+                pmf *= pl;
+            }
+            else {
+                index = node.right;
+                pmf *= 1 - pl;
+            }
+        }
+        const Light& light = lights[nodes[index].light];
+        light.object->Sample(pos, pdf);
+        pdf *= pmf;
+        return pdf > 0;
+    }
+
+private:
+    struct Light
+    {
+        Object* object;
+        Bounds3 bounds;
+        float power;
+        DirectionCone cone;
+    };
+    // depth-first order: the left child directly follows its parent
+    struct Node
+    {
+        Bounds3 bounds;
+        DirectionCone cone;
+        float power;
+        int right;      // index of the right child
+        int light;      // index into lights for leaves, -1 otherwise
+    };
+
+    // Conservative estimate of how much the lights below node can give to a
+    // point p with normal n: power / d^2 times the best emitter cosine and
+    // the best receiver cosine that any point in the box and any normal in
+    // the cone allow. Zero only where no light below can contribute.
+    static float Importance(const Vector3f& p, const Vector3f& n, const Node& node)
+    {
+        Vector3f center = 0.5f * (node.bounds.pMin + node.bounds.pMax);
+        Vector3f diag = node.bounds.Diagonal();
+        float radius2 = 0.25f * dotProduct(diag, diag);
+        Vector3f d = p - center;
+        float dist2 = dotProduct(d, d);
+        // don't let nearby nodes blow up: treat p as no closer than the box radius
+        float d2 = std::max(dist2, radius2);
+
+        // angle the box covers seen from p
+        float thetaU = dist2 <= radius2 ? (float)M_PI : std::asin(std::sqrt(radius2 / dist2));
+        Vector3f wi = dist2 > 0 ? d / std::sqrt(dist2) : Vector3f(0, 0, 1);
+
+        float thetaW = std::acos(clamp(-1, 1, dotProduct(node.cone.axis, wi)));
+        float thetaP = std::max(0.0f, thetaW - node.cone.theta - thetaU);
+        if (thetaP >= M_PI / 2)
+            return 0;
+        float cosP = std::cos(thetaP);
+
+        float thetaI = std::acos(clamp(-1, 1, dotProduct(n, -wi)));
+        float thetaIP = std::max(0.0f, thetaI - thetaU);
+        if (thetaIP >= M_PI / 2)
+            return 0;
+        float cosI = std::cos(thetaIP);
+
+        return node.power * cosP * cosI / d2;
+    }
+
+    // median split along the longest axis of the light centroids
+    int build(int start, int end)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(Node());
+        Node node;
+        node.bounds = lights[start].bounds;
+        node.cone = lights[start].cone;
+        node.power = lights[start].power;
+        for (int i = start + 1; i < end; ++i) {
+            node.bounds = Union(node.bounds, lights[i].bounds);
+            node.cone = DirectionCone::Union(node.cone, lights[i].cone);
+            node.power += lights[i].power;
+        }
+        node.light = -1;
+        node.right = -1;
+        if (end - start == 1)
+            node.light = start;
+        else {
+            Bounds3 centroids;
+            for (int i = start; i < end; ++i)
+                centroids = Union(centroids, lights[i].bounds.Centroid());
+            int dim = centroids.maxExtent();
+            int mid = (start + end) / 2;
+            auto axis = [dim](const Vector3f& v) { return dim == 0 ? v.x : dim == 1 ? v.y : v.z; };
+            std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end,
+                             [&](Light& a, Light& b) {
+                                 return axis(a.bounds.Centroid()) < axis(b.bounds.Centroid());
+                             });
+            build(start, mid);
+            node.right = build(mid, end);
+        }
+        nodes[index] = node;
+        return index;
+    }
+
+    std::vector<Light> lights;
+    std::vector<Node> nodes;
+};
+
+#endif // RAYTRACING_LIGHTBVH_H
@@ -0,0 +1,76 @@
+//
+// Bump allocator for acceleration structure nodes.
+//
+
+#ifndef RAYTRACING_MEMORYARENA_H
+#define RAYTRACING_MEMORYARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Hands out memory from large blocks and frees all of it at once when the
+// arena goes away. Destructors of the allocated objects are never run, so
+// only trivially destructible types should live here. Not thread-safe:
+// allocate from one thread, fill the memory from as many as you like.
+class MemoryArena
+{
+public:
+    explicit MemoryArena(size_t blockSize = 256 * 1024) : blockSize(blockSize) {}
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+    ~MemoryArena() { Reset(); }
+
+    void* Alloc(size_t nBytes)
+    {
+        // keep every allocation 16-byte aligned
+        nBytes = (nBytes + 15) & ~(size_t)15;
+        if (currentPos + nBytes > currentSize) {
+            currentSize = std::max(nBytes, blockSize);
+            currentBlock = static_cast<char*>(std::aligned_alloc(64, (currentSize + 63) & ~(size_t)63));
+            if (!currentBlock)
+                throw std::bad_alloc();
+            blocks.push_back(currentBlock);
+            currentPos = 0;
+        }
+        void* ret = currentBlock + currentPos;
+        currentPos += nBytes;
+        return ret;
+    }
+
+    template <typename T, typename... Args>
+    T* Alloc(Args&&... args)
+    {
+        return new (Alloc(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // n default-constructed objects in one contiguous run
+    template <typename T>
+    T* AllocArray(size_t n)
+    {
+        T* ret = static_cast<T*>(Alloc(n * sizeof(T)));
+        for (size_t i = 0; i < n; ++i)
+            new (&ret[i]) T();
+        return ret;
+    }
+
+    void Reset()
+    {
+        for (char* b : blocks)
+            std::free(b);
+        blocks.clear();
+        currentBlock = nullptr;
+        currentPos = currentSize = 0;
+    }
+
+private:
+    const size_t blockSize;
+    char* currentBlock = nullptr;
+    size_t currentPos = 0, currentSize = 0;
+    std::vector<char*> blocks;
+};
+
+#endif // RAYTRACING_MEMORYARENA_H
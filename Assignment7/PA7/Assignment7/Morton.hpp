@@ -0,0 +1,62 @@
+//
+// Morton (Z-order) codes used to sort rays and primitives spatially.
+//
+
+#ifndef RAYTRACING_MORTON_H
+#define RAYTRACING_MORTON_H
+
+#include <cstdint>
+#include "Vector.hpp"
+#include "global.hpp"
+
+// Spread the lower 10 bits of x so that there are two zero bits between each
+// of them: ---- --98 ---- 7--6 ---- 5--4 ---- 3--2 ---- 1--0 (bit positions)
+inline uint32_t LeftShift3(uint32_t x)
+{
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    x = (x | (x << 8))  & 0b00000011000000001111000000001111;
+    x = (x | (x << 4))  & 0b00000011000011000011000011000011;
+    x = (x | (x << 2))  & 0b00001001001001001001001001001001;
+    return x;
+}
+
+// 30-bit Morton code of a point given in [0,1]^3 (10 bits per axis)
+inline uint32_t EncodeMorton3(const Vector3f& v)
+{
+    auto quantize = [](float f) {
+        return (uint32_t)clamp(0.f, 1023.f, f * 1024.f);
+    };
+    return (LeftShift3(quantize(v.z)) << 2) | (LeftShift3(quantize(v.y)) << 1) |
+           LeftShift3(quantize(v.x));
+}
+
+// 64-bit variant of LeftShift3 for the lower 21 bits of x
+inline uint64_t LeftShift3(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffffull;
+    x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+    x = (x | (x << 8))  & 0x100f00f00f00f00full;
+    x = (x | (x << 4))  & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2))  & 0x1249249249249249ull;
+    return x;
+}
+
+// 63-bit Morton code of a point given in [0,1]^3 (21 bits per axis), for
+// meshes too dense for the 1024^3 grid of EncodeMorton3
+inline uint64_t EncodeMorton63(const Vector3f& v)
+{
+    auto quantize = [](float f) {
+        return (uint64_t)clamp(0.f, 2097151.f, f * 2097152.f);
+    };
+    return (LeftShift3(quantize(v.z)) << 2) | (LeftShift3(quantize(v.y)) << 1) |
+           LeftShift3(quantize(v.x));
+}
+
+// Index 0..7 of the octant a direction points into, one bit per sign
+inline uint32_t DirectionOctant(const Vector3f& d)
+{
+    return (d.x < 0) | ((d.y < 0) << 1) | ((d.z < 0) << 2);
+}
+
+#endif // RAYTRACING_MORTON_H
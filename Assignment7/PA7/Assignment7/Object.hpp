@@ -5,11 +5,13 @@
 #ifndef RAYTRACING_OBJECT_H
 #define RAYTRACING_OBJECT_H
 
+#include <vector>
 #include "Vector.hpp"
 #include "global.hpp"
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "RayPacket.hpp"
 
 class Object
 {
@@ -25,6 +27,33 @@ public:
     virtual float getArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    // Emitting primitives of the object, each one becomes a separate light
+    // in the light BVH
+    virtual void getEmitters(std::vector<Object*> &emitters)
+    {
+        if (hasEmit())
+            emitters.push_back(this);
+    }
+    // All normals of the surface lie within theta of axis; the default is
+    // the whole sphere
+    virtual void getNormalCone(Vector3f &axis, float &theta)
+    {
+        axis = Vector3f(0, 0, 1);
+        theta = M_PI;
+    }
+    // Closest hit for every ray of the packet; lanes only get updated when
+    // the hit is closer than packet.tHit. Objects without a packet kernel
+    // fall back to one getIntersection call per ray.
+    virtual void getIntersectionPacket(RayPacket &packet)
+    {
+        for (int i = 0; i < packet.size; ++i) {
+            Intersection inter = getIntersection(packet.GetRay(i));
+            if (inter.happened && inter.distance < packet.tHit[i]) {
+                packet.hit[i] = inter;
+                packet.tHit[i] = inter.distance;
+            }
+        }
+    }
 };
 
 
@@ -0,0 +1,209 @@
+//
+// Path guiding: incident radiance learned while rendering and used to pick
+// indirect directions. Follows Mueller et al., "Practical Path Guiding for
+// Efficient Light-Transport Simulation" (2017), with a fixed equal-area
+// histogram per spatial leaf instead of an adaptive directional quadtree.
+//
+
+#ifndef RAYTRACING_PATHGUIDING_H
+#define RAYTRACING_PATHGUIDING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "Vector.hpp"
+#include "global.hpp"
+#include "Bounds3.hpp"
+
+// std::atomic<float> has no fetch_add before C++20
+inline void AtomicAdd(std::atomic<float>& a, float v)
+{
+    float old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed))
+        ;
+}
+
+// Histogram over the whole sphere of directions. The cells are equal-area:
+// 16 steps in cos(theta) times 16 steps in phi, so each covers 4pi/256 sr
+// and a direction is sampled uniformly inside its cell.
+struct DirectionalDistribution
+{
+    static constexpr int Res = 16, Bins = Res * Res;
+
+    // learned in the previous iteration, only read while rendering
+    float cdf[Bins];
+    float total = 0;
+    // filled by the current iteration
+    std::atomic<float> record[Bins];
+    std::atomic<int> count{0};
+
+    DirectionalDistribution()
+    {
+        for (int i = 0; i < Bins; ++i) {
+            cdf[i] = 0;
+            record[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    static int Bin(const Vector3f& d)
+    {
+        int iz = std::max(0, std::min(Res - 1, (int)((d.z + 1) * 0.5f * Res)));
+        float phi = std::atan2(d.y, d.x);
+        if (phi < 0)
+            phi += 2 * M_PI;
+        int iphi = std::min(Res - 1, (int)(phi / (2 * M_PI) * Res));
+        return iz * Res + iphi;
+    }
+
+    bool Empty() const { return total <= 0; }
+
+    Vector3f Sample() const
+    {
+        float u = get_random_float() * total;
+        int bin = std::upper_bound(cdf, cdf + Bins, u) - cdf;
+        bin = std::min(bin, Bins - 1);
+        float z = -1 + 2 * ((bin / Res) + get_random_float()) / Res;
+        float phi = 2 * M_PI * ((bin % Res) + get_random_float()) / Res;
+        float r = std::sqrt(std::max(0.f, 1 - z * z));
+        return Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    float Pdf(const Vector3f& d) const
+    {
+        int bin = Bin(d);
+        float p = cdf[bin] - (bin > 0 ? cdf[bin - 1] : 0.f);
+        return p / total * Bins / (4 * M_PI);
+    }
+
+    // value: estimate of the radiance arriving from d, divided by the pdf
+    // it was sampled with
+    void Record(const Vector3f& d, float value)
+    {
+        AtomicAdd(record[Bin(d)], value);
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Turn the recording into the sampling distribution and start over. A
+    // leaf that saw nothing keeps what it had.
+    void Update()
+    {
+        float sum = 0;
+        for (int i = 0; i < Bins; ++i)
+            sum += record[i].load(std::memory_order_relaxed);
+        if (sum > 0) {
+            // a little uniform density so no cell is ruled out entirely
+            float floor = 0.01f * sum / Bins;
+            float c = 0;
+            for (int i = 0; i < Bins; ++i) {
+                c += record[i].load(std::memory_order_relaxed) + floor;
+                cdf[i] = c;
+            }
+            total = c;
+        }
+        for (int i = 0; i < Bins; ++i)
+            record[i].store(0, std::memory_order_relaxed);
+        count.store(0, std::memory_order_relaxed);
+    }
+
+    void CopyLearned(const DirectionalDistribution& d)
+    {
+        std::copy(d.cdf, d.cdf + Bins, cdf);
+        total = d.total;
+    }
+};
+
+// Binary space partition of the scene box; every leaf owns a directional
+// distribution. Leaves that received many samples in an iteration are split
+// in half along their longest axis before the next one, so resolution ends
+// up where paths actually go. Lookup and recording are safe from any number
+// of render threads; Refine must run between passes.
+class GuidingField
+{
+public:
+    // share of indirect samples taken from the field, the rest uses the BSDF
+    float guideFraction = 0.5f;
+    // recording is on during the training passes
+    bool recording = false;
+
+    explicit GuidingField(const Bounds3& bounds)
+    {
+        nodes.push_back({bounds, 0, 0.f, 0, 0});
+        leaves.emplace_back(new DirectionalDistribution());
+    }
+
+    DirectionalDistribution* Lookup(const Vector3f& p) const
+    {
+        const Node* node = &nodes[0];
+        while (node->leaf < 0) {
+            float v = node->axis == 0 ? p.x : node->axis == 1 ? p.y : p.z;
+            node = &nodes[node->child + (v >= node->split)];
+        }
+        return leaves[node->leaf].get();
+    }
+
+    // End of a training iteration: rebuild the distributions and split every
+    // leaf that saw more than c * sqrt(2^iteration) samples (the paper's rule,
+    // as every iteration traces twice the paths of the last). The halves are
+    // assumed to get half the samples each and are split again if that is
+    // still above the threshold.
+    void Refine()
+    {
+        const float threshold = 4000.f * std::sqrt((float)(1 << iteration));
+        std::vector<float> samples(nodes.size(), 0.f);
+        for (size_t i = 0; i < nodes.size(); ++i)
+            if (nodes[i].leaf >= 0)
+                samples[i] = (float)leaves[nodes[i].leaf]->count.load();
+
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].leaf < 0)
+                continue;
+            DirectionalDistribution& dist = *leaves[nodes[i].leaf];
+            dist.Update();
+            if (samples[i] <= threshold || nodes.size() + 2 > maxNodes)
+                continue;
+            const Bounds3 b = nodes[i].bounds;
+            int axis = b.maxExtent();
+            float mid = 0.5f * (b.pMin[axis] + b.pMax[axis]);
+            Bounds3 lo = b, hi = b;
+            if (axis == 0) { lo.pMax.x = mid; hi.pMin.x = mid; }
+            else if (axis == 1) { lo.pMax.y = mid; hi.pMin.y = mid; }
+            else { lo.pMax.z = mid; hi.pMin.z = mid; }
+
+            // the parent's leaf goes to the lower child, the upper one gets a copy
+            int child = (int)nodes.size();
+            int upper = (int)leaves.size();
+            leaves.emplace_back(new DirectionalDistribution());
+            leaves[upper]->CopyLearned(dist);
+            nodes.push_back({lo, 0, 0.f, 0, nodes[i].leaf});
+            nodes.push_back({hi, 0, 0.f, 0, upper});
+            samples.push_back(samples[i] / 2);
+            samples.push_back(samples[i] / 2);
+            nodes[i].axis = axis;
+            nodes[i].split = mid;
+            nodes[i].child = child;
+            nodes[i].leaf = -1;
+        }
+        ++iteration;
+    }
+
+    size_t LeafCount() const { return leaves.size(); }
+
+private:
+    struct Node
+    {
+        Bounds3 bounds;
+        int axis;
+        float split;
+        int child;      // children are child and child + 1
+        int leaf;       // index into leaves, -1 for interior nodes
+    };
+    static constexpr size_t maxNodes = 1 << 16;
+
+    std::vector<Node> nodes;
+    std::vector<std::unique_ptr<DirectionalDistribution>> leaves;
+    int iteration = 0;
+};
+
+#endif // RAYTRACING_PATHGUIDING_H
@@ -0,0 +1,93 @@
+//
+// Packets of coherent rays for the primary-ray fast path.
+//
+
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include "Vector.hpp"
+#include "global.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Ray.hpp"
+
+// 8x8 pixels at most
+constexpr int kMaxPacketSize = 64;
+
+// Rays sharing one origin (the camera rays of a pixel block). Directions are
+// kept as structure-of-arrays so the per-ray box tests run as plain loops over
+// all lanes that the compiler can vectorize. The packet is bounded by a
+// frustum of four planes through the origin, which lets a whole BVH node be
+// rejected with four dot products before any per-ray test.
+struct RayPacket
+{
+    int size = 0;
+    Vector3f origin;
+    alignas(32) float dx[kMaxPacketSize], dy[kMaxPacketSize], dz[kMaxPacketSize];
+    alignas(32) float ix[kMaxPacketSize], iy[kMaxPacketSize], iz[kMaxPacketSize];
+    // distance to the closest hit found so far, per ray
+    alignas(32) float tHit[kMaxPacketSize];
+    Intersection hit[kMaxPacketSize];
+
+    // inside the frustum when dotProduct(plane[i], p - origin) >= 0 for all i
+    Vector3f plane[4];
+    Vector3f center;
+
+    RayPacket(const Vector3f& o) : origin(o) {}
+
+    int Add(const Vector3f& dir)
+    {
+        dx[size] = dir.x; dy[size] = dir.y; dz[size] = dir.z;
+        ix[size] = 1.0f / dir.x; iy[size] = 1.0f / dir.y; iz[size] = 1.0f / dir.z;
+        tHit[size] = kInfinity;
+        hit[size] = Intersection();
+        return size++;
+    }
+
+    Vector3f Direction(int i) const { return Vector3f(dx[i], dy[i], dz[i]); }
+    Ray GetRay(int i) const { return Ray(origin, Direction(i)); }
+
+    // corner: directions of the four outermost rays, going around the block
+    void SetFrustum(const Vector3f corner[4])
+    {
+        center = normalize(corner[0] + corner[1] + corner[2] + corner[3]);
+        for (int i = 0; i < 4; ++i) {
+            plane[i] = crossProduct(corner[i], corner[(i + 1) % 4]);
+            if (dotProduct(plane[i], center) < 0)
+                plane[i] = -plane[i];
+        }
+    }
+
+    // true if the box lies completely outside one of the frustum planes
+    bool Culled(const Bounds3& b) const
+    {
+        for (int i = 0; i < 4; ++i) {
+            const Vector3f& n = plane[i];
+            Vector3f p(n.x >= 0 ? b.pMax.x : b.pMin.x,
+                       n.y >= 0 ? b.pMax.y : b.pMin.y,
+                       n.z >= 0 ? b.pMax.z : b.pMin.z);
+            if (dotProduct(n, p - origin) < 0)
+                return true;
+        }
+        return false;
+    }
+
+    // true if any ray enters the box before its closest hit so far
+    bool IntersectP(const Bounds3& b) const
+    {
+        float ox = b.pMin.x - origin.x, oy = b.pMin.y - origin.y, oz = b.pMin.z - origin.z;
+        float px = b.pMax.x - origin.x, py = b.pMax.y - origin.y, pz = b.pMax.z - origin.z;
+        int any = 0;
+        for (int i = 0; i < size; ++i) {
+            float t0x = ox * ix[i], t1x = px * ix[i];
+            float t0y = oy * iy[i], t1y = py * iy[i];
+            float t0z = oz * iz[i], t1z = pz * iz[i];
+            float tEnter = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::min(t0z, t1z));
+            float tExit = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::max(t0z, t1z));
+            any |= (tEnter <= tExit) & (tExit >= 0) & (tEnter < tHit[i]);
+        }
+        return any;
+    }
+};
+
+#endif // RAYTRACING_RAYPACKET_H
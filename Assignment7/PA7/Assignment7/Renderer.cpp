@@ -7,16 +7,143 @@
 #include "Renderer.hpp"
 
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 
-std::atomic_int progress= 0 ;
 std::mutex lock;
 
 inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
 
 const float EPSILON = 0.00001;
 
+// Primary rays of one tile traced as packets of packetSize x packetSize pixels.
+// Every packet is bounded by the rays through the outer corners of its block.
+void Renderer::RenderTilePackets(const Scene& scene, std::vector<Vector3f>& accum,
+                                 int samples, uint32_t x0, uint32_t y0,
+                                 uint32_t x1, uint32_t y1)
+{
+    float scale = tan(deg2rad(scene.fov * 0.5));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+    auto rayDir = [&](float px, float py) {
+        float x = (2 * px / (float)scene.width - 1) * imageAspectRatio * scale;
+        float y = (1 - 2 * py / (float)scene.height) * scale;
+        return normalize(Vector3f(-x, y, 1));
+    };
+
+    int block = packetSize;
+    std::vector<PathState> batch;
+    std::vector<Intersection> batchHits;
+    for (uint32_t by = y0; by < y1; by += block) {
+        for (uint32_t bx = x0; bx < x1; bx += block) {
+            uint32_t bx1 = std::min<uint32_t>(bx + block, x1);
+            uint32_t by1 = std::min<uint32_t>(by + block, y1);
+            RayPacket packet(eye_pos);
+            for (uint32_t j = by; j < by1; ++j)
+                for (uint32_t i = bx; i < bx1; ++i)
+                    packet.Add(rayDir(i + 0.5f, j + 0.5f));
+            Vector3f corner[4] = {rayDir(bx, by), rayDir(bx1, by),
+                                  rayDir(bx1, by1), rayDir(bx, by1)};
+            packet.SetFrustum(corner);
+            scene.intersectPacket(packet);
+
+            int lane = 0;
+            for (uint32_t j = by; j < by1; ++j) {
+                for (uint32_t i = bx; i < bx1; ++i, ++lane) {
+                    Ray ray = packet.GetRay(lane);
+                    uint32_t pixel = j * scene.width + i;
+                    for (int k = 0; k < samples; k++) {
+                        if (!Batched(scene)) {
+                            accum[pixel] += scene.shade(ray, packet.hit[lane], 0);
+                            continue;
+                        }
+                        batch.push_back({ray, Vector3f(1.0f), pixel});
+                        batchHits.push_back(packet.hit[lane]);
+                        if (batch.size() >= (size_t)rayBatchSize) {
+                            scene.castRayBatch(batch, accum, reorderRays, &batchHits);
+                            batch.clear();
+                            batchHits.clear();
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (!batch.empty())
+        scene.castRayBatch(batch, accum, reorderRays, &batchHits);
+}
+
+// Trace `samples` paths through every pixel and add their sum into accum.
+// The image is cut into tiles and the worker threads pull tiles from a shared
+// counter, so a pass always covers the whole image before it returns.
+void Renderer::RenderPass(const Scene& scene, std::vector<Vector3f>& accum,
+                          int samples, bool showProgress)
+{
+    float scale = tan(deg2rad(scene.fov * 0.5));
+    float imageAspectRatio = scene.width / (float)scene.height;
+    Vector3f eye_pos(278, 273, -800);
+
+    int tilesX = (scene.width + tileSize - 1) / tileSize;
+    int tilesY = (scene.height + tileSize - 1) / tileSize;
+    int numTiles = tilesX * tilesY;
+    std::atomic_int nextTile = 0;
+    std::atomic_int tilesDone = 0;
+
+    auto renderTiles = [&]() {
+        for (int tile = nextTile++; tile < numTiles; tile = nextTile++) {
+            uint32_t x0 = (tile % tilesX) * tileSize;
+            uint32_t y0 = (tile / tilesX) * tileSize;
+            uint32_t x1 = std::min<uint32_t>(x0 + tileSize, scene.width);
+            uint32_t y1 = std::min<uint32_t>(y0 + tileSize, scene.height);
+            if (packetTracing) {
+                RenderTilePackets(scene, accum, samples, x0, y0, x1, y1);
+            } else {
+                std::vector<PathState> batch;
+                for (uint32_t j = y0; j < y1; ++j) {
+                    for (uint32_t i = x0; i < x1; ++i) {
+                        // generate primary ray direction
+                        float x = (2 * (i + 0.5) / (float)scene.width - 1) *
+                                  imageAspectRatio * scale;
+                        float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
+
+                        Vector3f dir = normalize(Vector3f(-x, y, 1));
+                        uint32_t pixel = j * scene.width + i;
+                        for (int k = 0; k < samples; k++) {
+                            if (!Batched(scene)) {
+                                accum[pixel] += scene.castRay(Ray(eye_pos, dir), 0);
+                                continue;
+                            }
+                            batch.push_back({Ray(eye_pos, dir), Vector3f(1.0f), pixel});
+                            if (batch.size() >= (size_t)rayBatchSize) {
+                                scene.castRayBatch(batch, accum, reorderRays);
+                                batch.clear();
+                            }
+                        }
+                    }
+                }
+                if (!batch.empty())
+                    scene.castRayBatch(batch, accum, reorderRays);
+            }
+            int done = ++tilesDone;
+            if (showProgress) {
+                lock.lock();
+                UpdateProgress(done / (float)numTiles);
+                lock.unlock();
+            }
+        }
+    };
+
+    int thred = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> th;
+    // 启动线程
+    for (int i = 0; i < thred; i++)
+        th.emplace_back(renderTiles);
+    // 等待所有线程结束
+    for (auto& t : th)
+        t.join();
+}
+
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
@@ -24,58 +151,83 @@ void Renderer::Render(const Scene& scene)
 {
     std::vector<Vector3f> framebuffer(scene.width * scene.height);
 
-    float scale = tan(deg2rad(scene.fov * 0.5));
-    float imageAspectRatio = scene.width / (float)scene.height;
-    Vector3f eye_pos(278, 273, -800);
-    int m = 0;
-
     // change the spp value to change sample ammount
-    int spp = 16;
     std::cout << "SPP: " << spp << "\n";
 
-    const int thred = 24;
-    int per = scene.height / thred;
-    std::thread th[thred];
-
-    auto renderRow =[&](uint32_t lrow, uint32_t hrow){
-        for (uint32_t j = lrow; j < hrow; ++j) {
-        for (uint32_t i = 0; i < scene.width; ++i) {
-            // generate primary ray direction
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-            Vector3f dir = normalize(Vector3f(-x, y, 1));
-            for (int k = 0; k < spp; k++){
-                framebuffer[ (int)(j*scene.width + i)] += scene.castRay(Ray(eye_pos, dir), 0) / spp;  
-            }
+    int done = 0;
+    if (scene.guiding) {
+        scene.guiding->recording = true;
+        for (int pass = 0, n = 1; pass < guidingPasses && done + n < spp; ++pass, n *= 2) {
+            RenderPass(scene, framebuffer, n, false);
+            scene.guiding->Refine();
+            done += n;
+            std::cout << "Guiding pass " << pass << ": " << n << " spp, "
+                      << scene.guiding->LeafCount() << " leaves\n";
         }
-        lock.lock();
-        progress +=1;
-        UpdateProgress(progress / (float)scene.height);
-        lock.unlock();
+        scene.guiding->recording = false;
     }
+    RenderPass(scene, framebuffer, spp - done, true);
+    UpdateProgress(1.f);
+
+    SaveImage(scene, framebuffer, spp, "binary2.ppm");
+}
+
+// Time-budgeted render. Every pass adds one sample to every pixel; before a new
+// pass is started we check that the slowest pass seen so far still fits into
+// the remaining budget, so the last pass always finishes cleanly and the image
+// is delivered on time. At least one pass is always rendered.
+void Renderer::RenderTimeBudget(const Scene& scene, double budgetSeconds)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<Vector3f> framebuffer(scene.width * scene.height);
+
+    std::cout << "Time budget: " << budgetSeconds << " s\n";
+
+    auto start = clock::now();
+    auto seconds = [](clock::duration d) {
+        return std::chrono::duration<double>(d).count();
     };
 
-    // 启动线程
-    for(int i=0;i<thred;i++){
-        th[i] = std::thread(renderRow,i*per,(i+1)*per);
-    }
-    // 等待所有线程结束
-    for(int i=0;i<thred;i++)
-        th[i].join();
-    
+    int passes = 0;
+    double slowestPass = 0;
+    double elapsed = 0;
+    // guiding iterations end after 1, 3, 7, ... passes, doubling like Render
+    int guidingIteration = 0, nextRefine = 1;
+    if (scene.guiding)
+        scene.guiding->recording = guidingPasses > 0;
+    do {
+        auto passStart = clock::now();
+        RenderPass(scene, framebuffer, 1, false);
+        ++passes;
+        if (scene.guiding && scene.guiding->recording && passes == nextRefine) {
+            scene.guiding->Refine();
+            nextRefine += 2 << guidingIteration;
+            scene.guiding->recording = ++guidingIteration < guidingPasses;
+        }
+        slowestPass = std::max(slowestPass, seconds(clock::now() - passStart));
+        elapsed = seconds(clock::now() - start);
+        UpdateProgress(std::min(1.0, elapsed / budgetSeconds));
+    } while (elapsed + slowestPass < budgetSeconds);
     UpdateProgress(1.f);
 
-    // save framebuffer to file
-    FILE* fp = fopen("binary2.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
+    std::cout << "\nSPP achieved: " << passes << " (" << elapsed << " s)\n";
+
+    SaveImage(scene, framebuffer, passes, "binary2.ppm");
+}
+
+// save framebuffer to file; the pixels hold the sum of `samples` paths
+void Renderer::SaveImage(const Scene& scene, const std::vector<Vector3f>& framebuffer,
+                         int samples, const char* filename)
+{
+    FILE* fp = fopen(filename, "wb");
+    (void)fprintf(fp, "P6\n# spp %d\n%d %d\n255\n", samples, scene.width, scene.height);
     for (auto i = 0; i < scene.height * scene.width; ++i) {
         static unsigned char color[3];
-        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].x), 0.6f));
-        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].y), 0.6f));
-        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, framebuffer[i].z), 0.6f));
+        Vector3f c = framebuffer[i] / samples;
+        color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, c.x), 0.6f));
+        color[1] = (unsigned char)(255 * std::pow(clamp(0, 1, c.y), 0.6f));
+        color[2] = (unsigned char)(255 * std::pow(clamp(0, 1, c.z), 0.6f));
         fwrite(color, 1, 3, fp);
     }
-    fclose(fp);    
+    fclose(fp);
 }
@@ -15,7 +15,41 @@ struct hit_payload
 class Renderer
 {
 public:
+    // Render with a fixed number of samples per pixel (spp)
     void Render(const Scene& scene);
+    // Keep adding 1spp passes over all tiles until the wall-clock budget (in
+    // seconds) is about to run out, then write the image with the spp reached
+    void RenderTimeBudget(const Scene& scene, double budgetSeconds);
+
+    int spp = 16;
+    int tileSize = 32;
+    // Trace each tile as batches of paths, one bounce of all paths at a time
+    bool batchRays = false;
+    // Batch, and sort every bounce's secondary rays by (direction octant,
+    // origin Morton code) before tracing them
+    bool reorderRays = false;
+    int rayBatchSize = 4096;
+    // Trace the camera rays of packetSize x packetSize pixel blocks together
+    // as one RayPacket (4 or 8). The camera rays go through the pixel centers
+    // and do not change between samples, so they are traced once per pass.
+    bool packetTracing = false;
+    int packetSize = 8;
+    // With scene.guiding set, the first guidingPasses passes (1, 2, 4, ...
+    // spp) record into the guiding field and refine it; later passes just
+    // sample from it. Every pass adds to the image.
+    int guidingPasses = 4;
 
 private:
+    // the guiding field can only learn from the recursive integrator
+    bool Batched(const Scene& scene) const
+    {
+        return (batchRays || reorderRays) && !(scene.guiding && scene.guiding->recording);
+    }
+    // Trace `samples` paths for every pixel and add their sum into accum
+    void RenderPass(const Scene& scene, std::vector<Vector3f>& accum, int samples,
+                    bool showProgress);
+    void RenderTilePackets(const Scene& scene, std::vector<Vector3f>& accum, int samples,
+                           uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1);
+    void SaveImage(const Scene& scene, const std::vector<Vector3f>& framebuffer,
+                   int samples, const char* filename);
 };
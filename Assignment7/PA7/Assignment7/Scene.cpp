@@ -3,11 +3,20 @@
 //
 
 #include "Scene.hpp"
+#include "Morton.hpp"
 
 
 void Scene::buildBVH() {
     printf(" - Generating BVH...\n\n");
-    this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->bvh = new BVHAccel(objects, 1, splitMethod, lazyBVHDepth, compressBVH);
+}
+
+void Scene::buildLightBVH() {
+    std::vector<Object*> emitters;
+    for (auto object : objects)
+        object->getEmitters(emitters);
+    printf(" - Generating light BVH over %zu emitters...\n\n", emitters.size());
+    this->lightBVH = new LightBVH(emitters);
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -15,6 +24,11 @@ Intersection Scene::intersect(const Ray &ray) const
     return this->bvh->Intersect(ray);
 }
 
+void Scene::intersectPacket(RayPacket &packet) const
+{
+    this->bvh->IntersectPacket(packet);
+}
+
 void Scene::sampleLight(Intersection &pos, float &pdf) const
 {
     float emit_area_sum = 0;
@@ -23,6 +37,7 @@ void Scene::sampleLight(Intersection &pos, float &pdf) const
             emit_area_sum += objects[k]->getArea();   // 获得所有光源面积
         }
     }
+    float emit_area_sum_total = emit_area_sum;
     float p = get_random_float() * emit_area_sum;
     emit_area_sum = 0;
     for (uint32_t k = 0; k < objects.size(); ++k) {
@@ -30,6 +45,8 @@ void Scene::sampleLight(Intersection &pos, float &pdf) const
             emit_area_sum += objects[k]->getArea();
             if (p <= emit_area_sum){            // 在所有光源的各个分光源随机选一个进行采样
                 objects[k]->Sample(pos, pdf);
+                // pdf is per area of this light, which is picked with probability area / emit_area_sum
+                pdf *= objects[k]->getArea() / emit_area_sum_total;
                 break;
             }
         }
@@ -110,8 +127,12 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     // return l_dir + l_indir;
 
 
+    return shade(ray, Scene::intersect(ray), depth); //求一条光线与场景的交点
+}
+
+Vector3f Scene::shade(const Ray &ray, const Intersection &intersection, int depth) const
+{
     Vector3f L_dir = {0, 0, 0}, L_indir = {0, 0, 0};
-    Intersection intersection = Scene::intersect(ray); //求一条光线与场景的交点
     if (!intersection.happened) //没交点
         return {};
     if (intersection.m->hasEmission()) //一、交点是光源：
@@ -123,12 +144,53 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     }
     */
     //---------二、交点是物体：1)向光源采样计算direct----------
+    L_dir = sampleDirect(ray, intersection);
+    if (irradianceCache && depth == 0)
+        return L_dir + cachedIndirect(ray, intersection);
+
+    //--------二、交点是物体：2)向其他物体采样递归计算indirect---------
+    if (get_random_float() > RussianRoulette)     //打到物体后对半圆随机采样使用RR算法
+        return L_dir;
+    Vector3f w0;
+    float pdf;
+    sampleIndirect(ray, intersection, w0, pdf);
+    // guided directions may point into the surface and contribute nothing
+    if (dotProduct(w0, intersection.normal) <= 0)
+        return L_dir;
+    Ray object_to_object_ray(intersection.coords, w0);
+    Intersection islight = Scene::intersect(object_to_object_ray);
+    Vector3f L_i = {0, 0, 0};
+    if (islight.happened && !islight.m->hasEmission())
+    {   // shade(q, wi) * f_r * cos_theta / pdf_hemi / P_RR
+        auto f_r = intersection.m->eval(ray.direction, w0, intersection.normal);
+        L_i = castRay(object_to_object_ray, depth + 1);
+        L_indir = L_i * f_r * dotProduct(w0, intersection.normal) / pdf / RussianRoulette;
+    }
+    if (guiding && guiding->recording)
+        guiding->Lookup(intersection.coords)->Record(w0, Luminance(L_i) / pdf);
+    return L_dir + L_indir;
+}
+
+// Direct lighting at a non-emissive hit point: sample one point on the lights
+// and return its contribution if nothing blocks the way.
+Vector3f Scene::sampleDirect(const Ray &ray, const Intersection &intersection) const
+{
+    Vector3f L_dir = {0, 0, 0};
     Intersection lightpos;
     float lightpdf = 0.0f;
-    sampleLight(lightpos, lightpdf);//获得对光源的采样，包括光源的位置和采样的pdf(在场景的所有光源上按面积 uniform 地 sample 一个点，并计算该 sample 的概率密度)
+    if (lightBVH) {
+        // no light can reach this point
+        if (!lightBVH->Sample(intersection.coords, intersection.normal, lightpos, lightpdf))
+            return L_dir;
+    }
+    else
+        sampleLight(lightpos, lightpdf);//获得对光源的采样，包括光源的位置和采样的pdf(在场景的所有光源上按面积 uniform 地 sample 一个点，并计算该 sample 的概率密度)
     Vector3f collisionlight = lightpos.coords - intersection.coords;
     float dis = dotProduct(collisionlight, collisionlight);
     Vector3f collisionlightdir = collisionlight.normalized();   
+    // lights only emit from their front side
+    if (dotProduct(-collisionlightdir, lightpos.normal) <= 0)
+        return L_dir;
     Ray light_to_object_ray(intersection.coords, collisionlightdir);
     Intersection light_to_anything_ray = Scene::intersect(light_to_object_ray);
     auto f_r = intersection.m -> eval(ray.direction, collisionlightdir, intersection.normal);
@@ -136,20 +198,176 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         //L_dir = L_i * f_r * cos_theta * cos_theta_x / |x - p | ^ 2 / pdf_light
         L_dir = lightpos.emit * f_r * dotProduct(collisionlightdir, intersection.normal) * dotProduct(-collisionlightdir, lightpos.normal) / dis / lightpdf;
     }
+    return L_dir;
+}
 
-    //--------二、交点是物体：2)向其他物体采样递归计算indirect---------
-    if (get_random_float() > RussianRoulette)     //打到物体后对半圆随机采样使用RR算法
-        return L_dir;
-    Vector3f w0 = intersection.m -> sample(ray.direction, intersection.normal).normalized();
-    Ray object_to_object_ray(intersection.coords, w0);
-    Intersection islight = Scene::intersect(object_to_object_ray);
-    if (islight.happened && !islight.m->hasEmission())
-    {   // shade(q, wi) * f_r * cos_theta / pdf_hemi / P_RR
-        float pdf = intersection.m->pdf(ray.direction, w0, intersection.normal);
-        f_r = intersection.m->eval(ray.direction, w0, intersection.normal);
-        L_indir = castRay(object_to_object_ray, depth + 1) * f_r * dotProduct(w0, intersection.normal) / pdf / RussianRoulette;
+void Scene::sampleIndirect(const Ray &ray, const Intersection &inter, Vector3f &wi, float &pdf) const
+{
+    const DirectionalDistribution *dist = guiding ? guiding->Lookup(inter.coords) : nullptr;
+    if (!dist || dist->Empty()) {
+        wi = inter.m->sample(ray.direction, inter.normal).normalized();
+        pdf = inter.m->pdf(ray.direction, wi, inter.normal);
+        return;
     }
-    return L_dir + L_indir;
+    float alpha = guiding->guideFraction;
+    if (get_random_float() < alpha)
+        wi = dist->Sample();
+    else
+        wi = inter.m->sample(ray.direction, inter.normal).normalized();
+    pdf = alpha * dist->Pdf(wi) + (1 - alpha) * inter.m->pdf(ray.direction, wi, inter.normal);
+}
+
+Vector3f Scene::cachedIndirect(const Ray &ray, const Intersection &inter) const
+{
+    Vector3f E;
+    if (!irradianceCache->Lookup(inter.coords, inter.normal, E)) {
+        IrradianceRecord record = computeIrradiance(inter);
+        irradianceCache->Add(record);
+        E = record.E;
+    }
+    // DIFFUSE: f_r = Kd / pi for every pair of directions above the surface
+    return inter.m->eval(ray.direction, inter.normal, inter.normal) * E;
+}
+
+// Indirect irradiance at a hit point from thetaSteps x phiSteps stratified,
+// cosine-distributed rays, each continued by the path tracer. Rays that hit a
+// light add nothing, the direct part comes from sampleDirect as usual. The
+// gradients are the ones of Ward and Heckbert for this stratification:
+//   rotation:    pi/(MN) sum_k v_k sum_j -tan(theta_j) L_jk
+//   translation: sum_k u_k 2pi/N sum_j sin(theta_j-) cos^2(theta_j-) / min(r_jk, r_j-1,k) (L_jk - L_j-1,k)
+//              + v_k- sum_j (sin(theta_j+) - sin(theta_j-)) / min(r_jk, r_j,k-1) (L_jk - L_j,k-1)
+// with u_k the direction of cell k in the tangent plane, v_k perpendicular to
+// it, theta_j-/+ and phi_k- the cell boundaries.
+IrradianceRecord Scene::computeIrradiance(const Intersection &inter) const
+{
+    const int M = irradianceCache->thetaSteps, N = irradianceCache->phiSteps;
+    const Vector3f n = inter.normal;
+    const Vector3f t = std::fabs(n.x) > std::fabs(n.y)
+                           ? Vector3f(n.z, 0.0f, -n.x) / std::sqrt(n.x * n.x + n.z * n.z)
+                           : Vector3f(0.0f, n.z, -n.y) / std::sqrt(n.y * n.y + n.z * n.z);
+    const Vector3f b = crossProduct(n, t);
+
+    std::vector<Vector3f> L(M * N);
+    std::vector<float> r(M * N);
+    Vector3f sumL(0.0f);
+    float sumInvDist = 0;
+    for (int j = 0; j < M; ++j) {
+        for (int k = 0; k < N; ++k) {
+            float u = (j + get_random_float()) / M;
+            float sinTheta = std::sqrt(u), cosTheta = std::sqrt(1 - u);
+            float phi = 2 * M_PI * (k + get_random_float()) / N;
+            Vector3f dir = t * (sinTheta * std::cos(phi)) + b * (sinTheta * std::sin(phi)) + n * cosTheta;
+            Ray ray(inter.coords, dir);
+            Intersection hit = Scene::intersect(ray);
+            r[j * N + k] = hit.happened ? hit.distance : kInfinity;
+            if (hit.happened && !hit.m->hasEmission())
+                L[j * N + k] = shade(ray, hit, 1);
+            sumL += L[j * N + k];
+            sumInvDist += 1 / r[j * N + k];
+        }
+    }
+
+    IrradianceRecord record;
+    record.position = inter.coords;
+    record.normal = n;
+    record.E = sumL * (M_PI / (M * N));
+    record.R = sumInvDist > 0 ? M * N / sumInvDist : kInfinity;
+
+    // gradients in the tangent frame, one color per tangent axis
+    Vector3f rotT(0.0f), rotB(0.0f), transT(0.0f), transB(0.0f);
+    auto at = [&](std::vector<Vector3f> &v, int j, int k) -> Vector3f & { return v[j * N + (k + N) % N]; };
+    auto dist = [&](int j, int k) { return r[j * N + (k + N) % N]; };
+    for (int k = 0; k < N; ++k) {
+        float phi = 2 * M_PI * (k + 0.5f) / N, phiMinus = 2 * M_PI * k / N;
+        float ux = std::cos(phi), uy = std::sin(phi);
+        float vx = -std::sin(phi), vy = std::cos(phi);
+        float vmx = -std::sin(phiMinus), vmy = std::cos(phiMinus);
 
+        Vector3f rot(0.0f), transU(0.0f), transV(0.0f);
+        for (int j = 0; j < M; ++j) {
+            float s2 = (j + 0.5f) / M;
+            rot += at(L, j, k) * -std::sqrt(s2 / (1 - s2));
+            float sinMinus = std::sqrt((float)j / M), sinPlus = std::sqrt((float)(j + 1) / M);
+            if (j > 0)
+                transU += (at(L, j, k) - at(L, j - 1, k)) *
+                          (sinMinus * (1 - sinMinus * sinMinus) / std::min(dist(j, k), dist(j - 1, k)));
+            transV += (at(L, j, k) - at(L, j, k - 1)) *
+                      ((sinPlus - sinMinus) / std::min(dist(j, k), dist(j, k - 1)));
+        }
+        rotT += rot * vx;
+        rotB += rot * vy;
+        transU = transU * (2 * M_PI / N);
+        transT += transU * ux + transV * vmx;
+        transB += transU * uy + transV * vmy;
+    }
+    rotT = rotT * (M_PI / (M * N));
+    rotB = rotB * (M_PI / (M * N));
+    for (int a = 0; a < 3; ++a) {
+        record.rot[a] = rotT * t[a] + rotB * b[a];
+        record.trans[a] = transT * t[a] + transB * b[a];
+    }
+    return record;
+}
 
+// Batched version of castRay. All paths advance one bounce at a time: trace,
+// add direct lighting, roulette, then spawn the next ray. A secondary ray that
+// hits a light or nothing adds no radiance (direct lighting already covered
+// the lights), exactly like the recursive version.
+void Scene::castRayBatch(std::vector<PathState> &paths, std::vector<Vector3f> &accum, bool reorder,
+                         const std::vector<Intersection> *primaryHits) const
+{
+    std::vector<PathState> next;
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    Bounds3 sceneBounds = bvh->WorldBound();
+    next.reserve(paths.size());
+
+    for (int depth = 0; !paths.empty(); ++depth) {
+        if (reorder && depth > 0) {
+            // key = direction octant (3 bits) | origin Morton code (30 bits)
+            keys.resize(paths.size());
+            for (uint32_t i = 0; i < paths.size(); ++i) {
+                const Ray &r = paths[i].ray;
+                uint64_t key = ((uint64_t)DirectionOctant(r.direction) << 30) |
+                               EncodeMorton3(sceneBounds.Offset(r.origin));
+                keys[i] = {key, i};
+            }
+            std::sort(keys.begin(), keys.end());
+            next.clear();
+            for (auto &k : keys)
+                next.push_back(paths[k.second]);
+            paths.swap(next);
+        }
+
+        next.clear();
+        for (uint32_t i = 0; i < paths.size(); ++i) {
+            const PathState &path = paths[i];
+            Intersection intersection = (depth == 0 && primaryHits) ? (*primaryHits)[i]
+                                                                    : Scene::intersect(path.ray);
+            if (!intersection.happened)
+                continue;
+            if (intersection.m->hasEmission()) {
+                if (depth == 0)
+                    accum[path.pixel] += intersection.m->getEmission();
+                continue;
+            }
+
+            accum[path.pixel] += path.throughput * sampleDirect(path.ray, intersection);
+            if (irradianceCache && depth == 0) {
+                accum[path.pixel] += path.throughput * cachedIndirect(path.ray, intersection);
+                continue;
+            }
+
+            if (get_random_float() > RussianRoulette)
+                continue;
+            Vector3f w0;
+            float pdf;
+            sampleIndirect(path.ray, intersection, w0, pdf);
+            if (dotProduct(w0, intersection.normal) <= 0)
+                continue;
+            auto f_r = intersection.m->eval(path.ray.direction, w0, intersection.normal);
+            Vector3f throughput = path.throughput * f_r * dotProduct(w0, intersection.normal) / pdf / RussianRoulette;
+            next.push_back({Ray(intersection.coords, w0), throughput, path.pixel});
+        }
+        paths.swap(next);
+    }
 }
\ No newline at end of file
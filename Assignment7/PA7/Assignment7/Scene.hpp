@@ -10,8 +10,18 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "PathGuiding.hpp"
+#include "IrradianceCache.hpp"
+#include "LightBVH.hpp"
 #include "Ray.hpp"
 
+// One path in flight in the batched integrator (Scene::castRayBatch)
+struct PathState
+{
+    Ray ray;
+    Vector3f throughput;
+    uint32_t pixel;
+};
 
 class Scene
 {
@@ -23,6 +33,18 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 1;
     float RussianRoulette = 0.8;
+    BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE;
+    // levels of each BVH built up front, the rest on demand (negative: all)
+    int lazyBVHDepth = -1;
+    // store each BVH as quantized 4-wide nodes
+    bool compressBVH = false;
+    // learned incident radiance for picking indirect directions, optional
+    GuidingField *guiding = nullptr;
+    // cached indirect irradiance for camera hits, optional
+    IrradianceCache *irradianceCache = nullptr;
+    // lights picked by their importance to the shading point instead of by
+    // area, built by buildLightBVH
+    LightBVH *lightBVH = nullptr;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -33,9 +55,31 @@ public:
     const std::vector<Object*>& get_objects() const { return objects; }
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
+    // Closest hits of all rays of a packet, see RayPacket
+    void intersectPacket(RayPacket &packet) const;
     BVHAccel *bvh;
     void buildBVH();
+    void buildLightBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
+    // castRay for a ray whose closest hit is already known
+    Vector3f shade(const Ray &ray, const Intersection &intersection, int depth) const;
+    // Trace a batch of camera paths bounce by bounce and add their radiance
+    // into accum[path.pixel]. With reorder set, the secondary rays of every
+    // bounce are sorted by direction octant and origin Morton code first so
+    // that consecutive rays walk the same part of the BVH. primaryHits, if
+    // given, holds the closest hit of every path's first ray so the first
+    // bounce does not trace again.
+    void castRayBatch(std::vector<PathState> &paths, std::vector<Vector3f> &accum, bool reorder,
+                      const std::vector<Intersection> *primaryHits = nullptr) const;
+    Vector3f sampleDirect(const Ray &ray, const Intersection &inter) const;
+    // Indirect direction at a hit point and its pdf. With a guiding field the
+    // direction comes from the field or the BSDF (one-sample MIS), and the pdf
+    // is the mixture of both.
+    void sampleIndirect(const Ray &ray, const Intersection &inter, Vector3f &wi, float &pdf) const;
+    // Indirect light leaving a diffuse camera hit, interpolated from the
+    // irradiance cache; a new record is computed when none is close enough.
+    Vector3f cachedIndirect(const Ray &ray, const Intersection &inter) const;
+    IrradianceRecord computeIrradiance(const Intersection &inter) const;
     void sampleLight(Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
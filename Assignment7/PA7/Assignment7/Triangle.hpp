@@ -62,6 +62,7 @@ public:
     bool intersect(const Ray& ray, float& tnear,
                    uint32_t& index) const override;
     Intersection getIntersection(Ray ray) override;
+    void getIntersectionPacket(RayPacket& packet) override;
     void getSurfaceProperties(const Vector3f& P, const Vector3f& I,
                               const uint32_t& index, const Vector2f& uv,
                               Vector3f& N, Vector2f& st) const override
@@ -77,6 +78,7 @@ public:
         float x = std::sqrt(get_random_float()), y = get_random_float();
         pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
         pos.normal = this->normal;
+        pos.emit = m->getEmission();
         pdf = 1.0f / area;
     }
     float getArea(){
@@ -85,6 +87,10 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    void getNormalCone(Vector3f &axis, float &theta){
+        axis = normal;
+        theta = 0;
+    }
 };// end class triangle
 
 
@@ -94,7 +100,9 @@ public:
 class MeshTriangle : public Object
 {
 public:
-    MeshTriangle(const std::string& filename, Material *mt = new Material())
+    MeshTriangle(const std::string& filename, Material *mt = new Material(),
+                 BVHAccel::SplitMethod splitMethod = BVHAccel::SplitMethod::NAIVE,
+                 int lazyBVHDepth = -1, bool compressBVH = false)
     {
         objl::Loader loader;
         loader.LoadFile(filename);
@@ -137,7 +145,7 @@ public:
             ptrs.push_back(&tri);
             area += tri.area;   // 累加每一个三角形面积
         }
-        bvh = new BVHAccel(ptrs);
+        bvh = new BVHAccel(ptrs, 1, splitMethod, lazyBVHDepth, compressBVH);
     }
 
     bool intersect(const Ray& ray) { return true; }
@@ -199,6 +207,12 @@ public:
 
         return intersec;
     }
+
+    void getIntersectionPacket(RayPacket& packet)
+    {
+        if (bvh)
+            bvh->IntersectPacket(packet);
+    }
     // 获取交点信息(包括 coords, normal, emit)与 pdf, 
     void Sample(Intersection &pos, float &pdf){
         bvh->Sample(pos, pdf);
@@ -210,6 +224,12 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    void getEmitters(std::vector<Object*> &emitters){
+        if (!hasEmit())
+            return;
+        for (auto& tri : triangles)
+            emitters.push_back(&tri);
+    }
 
     Bounds3 bounding_box;
     std::unique_ptr<Vector3f[]> vertices;
@@ -275,6 +295,48 @@ inline Intersection Triangle::getIntersection(Ray ray)
 
 }
 
+// 三角形求交 Moller法则, the same test as getIntersection run over all rays of
+// the packet at once; the per-lane loop has no branches so it vectorizes
+inline void Triangle::getIntersectionPacket(RayPacket& packet)
+{
+    alignas(32) float tCand[kMaxPacketSize];
+    Vector3f tvec = packet.origin - v0;
+    Vector3f qvec = crossProduct(tvec, e1);
+    float qe2 = dotProduct(e2, qvec);
+    int any = 0;
+    for (int i = 0; i < packet.size; ++i) {
+        float dx = packet.dx[i], dy = packet.dy[i], dz = packet.dz[i];
+        float facing = dx * normal.x + dy * normal.y + dz * normal.z;
+        // pvec = dir x e2
+        float px = dy * e2.z - dz * e2.y;
+        float py = dz * e2.x - dx * e2.z;
+        float pz = dx * e2.y - dy * e2.x;
+        float det = e1.x * px + e1.y * py + e1.z * pz;
+        float det_inv = 1.0f / det;
+        float u = (tvec.x * px + tvec.y * py + tvec.z * pz) * det_inv;
+        float v = (dx * qvec.x + dy * qvec.y + dz * qvec.z) * det_inv;
+        float t = qe2 * det_inv;
+        int ok = (facing <= 0) & (std::fabs(det) >= EPSILON) & (u >= 0) & (u <= 1) &
+                 (v >= 0) & (u + v <= 1) & (t < packet.tHit[i]);
+        tCand[i] = ok ? t : kInfinity;
+        any |= ok;
+    }
+    if (!any)
+        return;
+    for (int i = 0; i < packet.size; ++i) {
+        if (tCand[i] == kInfinity)
+            continue;
+        Intersection& inter = packet.hit[i];
+        inter.happened = true;
+        inter.obj = this;
+        inter.distance = tCand[i];
+        inter.normal = normal;
+        inter.coords = packet.origin + packet.Direction(i) * tCand[i];
+        inter.m = this->m;
+        packet.tHit[i] = tCand[i];
+    }
+}
+
 inline Vector3f Triangle::evalDiffuseColor(const Vector2f&) const
 {
     return Vector3f(0.5, 0.5, 0.5);
@@ -64,6 +64,10 @@ public:
     float x, y;
 };
 
+// perceived brightness of a linear RGB color
+inline float Luminance(const Vector3f &c)
+{ return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
 inline Vector3f lerp(const Vector3f &a, const Vector3f& b, const float &t)
 { return a * (1 - t) + b * t; }
 
@@ -5,6 +5,36 @@
 #include "Vector.hpp"
 #include "global.hpp"
 #include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+static void PrintUsage(const char* program)
+{
+    std::cerr << "usage: " << program << " [--spp N | --budget SECONDS] [--batch] [--reorder] [--packets [N]]\n"
+              << "       [--lbvh] [--lazy-bvh D] [--compress-bvh] [--guide] [--irradiance-cache [a]] [--light-bvh]\n";
+}
+
+// false unless text is a whole number / a number and nothing else
+static bool ParseInt(const char* text, int& value)
+{
+    char* end;
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    if (end == text || *end || errno || v < INT_MIN || v > INT_MAX)
+        return false;
+    value = (int)v;
+    return true;
+}
+
+static bool ParseDouble(const char* text, double& value)
+{
+    char* end;
+    errno = 0;
+    value = strtod(text, &end);
+    return end != text && !*end && !errno && std::isfinite(value);
+}
 
 // In the main function of the program, we create the scene (create objects and
 // lights) as well as set the options for the render (image width and height,
@@ -16,6 +46,107 @@ int main(int argc, char** argv)
     // Change the definition here to change resolution
     Scene scene(720, 720);
 
+    Renderer r;
+
+    // --spp N        fixed sample count (default 16)
+    // --budget S     render as many passes as fit into S seconds
+    // --batch        trace the paths in batches, a bounce at a time
+    // --reorder      batch and sort secondary rays by Morton code before tracing
+    // --packets [N]  trace camera rays in NxN packets (N = 4 or 8, default 8)
+    // --lbvh         build the BVHs with the Morton-code LBVH builder
+    // --lazy-bvh D   build only the top D levels up front, the rest on demand
+    // --compress-bvh store the BVHs as quantized 4-wide nodes
+    // --guide        learn a path guiding field while rendering
+    // --irradiance-cache [a]  interpolate indirect light at camera hits
+    //                (a: Ward's error bound, default 0.3)
+    // --light-bvh    sample lights through a light BVH by their importance
+    double budget = 0;
+    bool sppGiven = false;
+    bool guide = false;
+    bool lightBVH = false;
+    float cacheError = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--spp")) {
+            // SaveImage divides by the sample count
+            if (i + 1 >= argc || !ParseInt(argv[++i], r.spp) || r.spp < 1) {
+                std::cerr << "--spp takes a whole number of samples per pixel, at least 1\n";
+                PrintUsage(argv[0]);
+                return 1;
+            }
+            sppGiven = true;
+        }
+        else if (!strcmp(argv[i], "--budget")) {
+            if (i + 1 >= argc || !ParseDouble(argv[++i], budget) || budget <= 0) {
+                std::cerr << "--budget takes a number of seconds greater than 0\n";
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--batch"))
+            r.batchRays = true;
+        else if (!strcmp(argv[i], "--reorder"))
+            r.reorderRays = true;
+        else if (!strcmp(argv[i], "--lazy-bvh")) {
+            if (i + 1 >= argc || !ParseInt(argv[++i], scene.lazyBVHDepth)
+                || scene.lazyBVHDepth < 0) {
+                std::cerr << "--lazy-bvh takes a whole number of eagerly built levels, at least 0\n";
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--irradiance-cache")) {
+            cacheError = 0.3f;
+            // the error bound is optional, so only a number is taken as one
+            double error;
+            if (i + 1 < argc && ParseDouble(argv[i + 1], error)) {
+                ++i;
+                if (error <= 0) {
+                    std::cerr << "--irradiance-cache takes an error bound greater than 0\n";
+                    PrintUsage(argv[0]);
+                    return 1;
+                }
+                cacheError = error;
+            }
+        }
+        else if (!strcmp(argv[i], "--light-bvh"))
+            lightBVH = true;
+        else if (!strcmp(argv[i], "--guide"))
+            guide = true;
+        else if (!strcmp(argv[i], "--compress-bvh"))
+            scene.compressBVH = true;
+        else if (!strcmp(argv[i], "--lbvh"))
+            scene.splitMethod = BVHAccel::SplitMethod::LBVH;
+        else if (!strcmp(argv[i], "--packets")) {
+            r.packetTracing = true;
+            int size;
+            if (i + 1 < argc && ParseInt(argv[i + 1], size)) {
+                ++i;
+                if (size != 4 && size != 8) {
+                    std::cerr << "--packets takes a packet size of 4 or 8\n";
+                    PrintUsage(argv[0]);
+                    return 1;
+                }
+                r.packetSize = size;
+            }
+        }
+        else {
+            std::cerr << "unknown option " << argv[i] << "\n";
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    // the LBVH builder emits the whole tree bottom-up, it has no lazy levels
+    if (scene.lazyBVHDepth >= 0 && scene.splitMethod == BVHAccel::SplitMethod::LBVH) {
+        std::cerr << "--lazy-bvh only applies to the recursive builder, not --lbvh\n";
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (sppGiven && budget > 0) {
+        std::cerr << "--spp and --budget cannot be used together\n";
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
     Material* red = new Material(DIFFUSE, Vector3f(0.0f));
     red->Kd = Vector3f(0.63f, 0.065f, 0.05f);
     Material* green = new Material(DIFFUSE, Vector3f(0.0f));
@@ -25,12 +156,12 @@ int main(int argc, char** argv)
     Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f+0.058f, 0.747f+0.258f, 0.747f) + 15.6f * Vector3f(0.740f+0.287f,0.740f+0.160f,0.740f) + 18.4f *Vector3f(0.737f+0.642f,0.737f+0.159f,0.737f)));
     light->Kd = Vector3f(0.65f);
 
-    MeshTriangle floor("../models/cornellbox/floor.obj", white);
-    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
-    MeshTriangle left("../models/cornellbox/left.obj", red);
-    MeshTriangle right("../models/cornellbox/right.obj", green);
-    MeshTriangle light_("../models/cornellbox/light.obj", light);
+    MeshTriangle floor("../models/cornellbox/floor.obj", white, scene.splitMethod, scene.lazyBVHDepth, scene.compressBVH);
+    MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white, scene.splitMethod, scene.lazyBVHDepth, scene.compressBVH);
+    MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white, scene.splitMethod, scene.lazyBVHDepth, scene.compressBVH);
+    MeshTriangle left("../models/cornellbox/left.obj", red, scene.splitMethod, scene.lazyBVHDepth, scene.compressBVH);
+    MeshTriangle right("../models/cornellbox/right.obj", green, scene.splitMethod, scene.lazyBVHDepth, scene.compressBVH);
+    MeshTriangle light_("../models/cornellbox/light.obj", light, scene.splitMethod, scene.lazyBVHDepth, scene.compressBVH);
 
     scene.Add(&floor);
     scene.Add(&shortbox);
@@ -40,11 +171,26 @@ int main(int argc, char** argv)
     scene.Add(&light_);
 
     scene.buildBVH();
+    if (lightBVH)
+        scene.buildLightBVH();
 
-    Renderer r;
+    std::unique_ptr<GuidingField> guiding;
+    if (guide) {
+        guiding.reset(new GuidingField(scene.bvh->WorldBound()));
+        scene.guiding = guiding.get();
+    }
+    std::unique_ptr<IrradianceCache> irradianceCache;
+    if (cacheError > 0) {
+        irradianceCache.reset(new IrradianceCache(scene.bvh->WorldBound()));
+        irradianceCache->maxError = cacheError;
+        scene.irradianceCache = irradianceCache.get();
+    }
 
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    if (budget > 0)
+        r.RenderTimeBudget(scene, budget);
+    else
+        r.Render(scene);
     auto stop = std::chrono::system_clock::now();
 
     std::cout << "Render complete: \n";
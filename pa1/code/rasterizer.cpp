@@ -11,16 +11,16 @@
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    pos_buf.push_back(positions);
+    int id = (int)pos_buf.size() - 1;
 
     return {id};
 }
 
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    ind_buf.push_back(indices);
+    int id = (int)ind_buf.size() - 1;
 
     return {id};
 }
@@ -138,39 +138,64 @@ void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffe
     {
         throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
     }
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
+    auto& buf = pos_buf.at(pos_buffer.pos_id);
+    auto& ind = ind_buf.at(ind_buffer.ind_id);
 
     float f1 = (100 - 0.1) / 2.0;
     float f2 = (100 + 0.1) / 2.0;
 
     Eigen::Matrix4f mvp = projection * view * model;
+    // draw_line walks every pixel of a line, off the screen too, so the guard band is narrow
+    Clipper clipper(projection, 2.0f);
     for (auto& i : ind)
     {
-        Triangle t;
-
-        Eigen::Vector4f v[] = {
+        Eigen::Vector4f clip[] = {
                 mvp * to_vec4(buf[i[0]], 1.0f),
                 mvp * to_vec4(buf[i[1]], 1.0f),
                 mvp * to_vec4(buf[i[2]], 1.0f)
         };
+        Clipper::Vertex polygon[Clipper::max_vertices];
+        int count = 3;
+        Clipper::Result result = clipper.clip(clip, polygon, count);
+        if (result == Clipper::Outside)
+            continue;
+        if (result == Clipper::Inside)
+            for (int k = 0; k < 3; ++k)
+                polygon[k] = {clip[k], Eigen::Vector3f::Unit(k)};
 
-        for (auto& vec : v) {
+        Eigen::Vector4f v[Clipper::max_vertices];
+        for (int k = 0; k < count; ++k)
+            v[k] = polygon[k].pos;
+
+        for (int k = 0; k < count; ++k) {
+            auto& vec = v[k];
             vec /= vec.w();
         }
 
-        for (auto & vert : v)
+        for (int k = 0; k < count; ++k)
         {
+            auto& vert = v[k];
             vert.x() = 0.5*width*(vert.x()+1.0);
             vert.y() = 0.5*height*(vert.y()+1.0);
             vert.z() = vert.z() * f1 + f2;
         }
 
+        // the clipped polygon is convex, its first three vertices give its winding
+        if (Clipper::culled(cull, v[0].head<2>(), v[1].head<2>(), v[2].head<2>()))
+            continue;
+
+        if (count > 3)
+        {
+            // cut by the near or far plane: draw the outline of what is left
+            for (int k = 0; k < count; ++k)
+                draw_line(v[k].head<3>(), v[(k + 1) % count].head<3>());
+            continue;
+        }
+
+        Triangle t;
         for (int i = 0; i < 3; ++i)
         {
             t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
         }
 
         t.setColor(0, 255.0,  0.0,  0.0);
@@ -188,6 +213,11 @@ void rst::rasterizer::rasterize_wireframe(const Triangle& t)
     draw_line(t.b(), t.a());
 }
 
+void rst::rasterizer::set_cull(Cull mode)
+{
+    cull = mode;
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "Triangle.hpp"
+#include "Clipper.hpp"
 #include <algorithm>
 #include <eigen3/Eigen/Eigen>
 using namespace Eigen;
@@ -57,6 +58,8 @@ class rasterizer
     void set_model(const Eigen::Matrix4f& m);
     void set_view(const Eigen::Matrix4f& v);
     void set_projection(const Eigen::Matrix4f& p);
+    // back face culling is off until this says otherwise
+    void set_cull(Cull mode);
 
     void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
@@ -75,16 +78,16 @@ class rasterizer
     Eigen::Matrix4f view;
     Eigen::Matrix4f projection;
 
-    std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-    std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
+    Cull cull = Cull::None;
+
+    // a flat array of buffers per kind, a buffer id is the slot of its buffer
+    std::vector<std::vector<Eigen::Vector3f>> pos_buf;
+    std::vector<std::vector<Eigen::Vector3i>> ind_buf;
 
     std::vector<Eigen::Vector3f> frame_buf;
     std::vector<float> depth_buf;
     int get_index(int x, int y);
 
     int width, height;
-
-    int next_id = 0;
-    int get_next_id() { return next_id++; }
 };
 } // namespace rst
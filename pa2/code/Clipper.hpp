@@ -0,0 +1,162 @@
+//
+// Frustum clipping and face culling
+//
+
+#pragma once
+
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+
+namespace rst
+{
+    // Which faces are not drawn. A face is front facing when its vertices are counter clockwise
+    // on the screen, the order Triangle expects.
+    enum class Cull
+    {
+        None,
+        Back,
+        Front
+    };
+
+    // Works on a triangle in clip space, after the projection matrix and before the division by w.
+    //  * A triangle that lies entirely outside one plane of the view frustum is rejected.
+    //  * Only the near and far planes cut triangles. To the sides the rasterizer copes with vertices
+    //    off the screen (it only visits pixels on the screen), so a triangle is cut there only when
+    //    a vertex lies outside the guard band, a lot farther out, where its screen coordinates
+    //    would be too big for the fixed point edge functions.
+    // The clipped polygon keeps the triangle's winding. Every vertex of it comes with its weights
+    // over the three original vertices: attributes are linear in clip space, so the attributes of a
+    // new vertex are the weighted sums of the original ones.
+    class Clipper
+    {
+    public:
+        // a triangle cut by all 6 planes of clip() has at most 3 + 6 vertices
+        static constexpr int max_vertices = 9;
+
+        struct Vertex
+        {
+            Eigen::Vector4f pos;
+            Eigen::Vector3f weights;
+        };
+
+        enum Result
+        {
+            Outside,   // nothing of the triangle is in the frustum
+            Inside,    // drawable as it is
+            Clipped    // the drawable part is the polygon clip() returned
+        };
+
+        // projection tells on which side of w = 0 the camera looks (it looks down -z in view space,
+        // the projections of these assignments make w negative in front of it).
+        // guard_band is in NDC units: 1 is the edge of the screen.
+        Clipper(const Eigen::Matrix4f& projection, float guard_band)
+            : w_sign(projection(3, 2) > 0 ? -1.0f : 1.0f), guard(guard_band) {}
+
+        // v: the clip space vertices. For Clipped, out[0..count) is the polygon, a triangle fan
+        // around out[0].
+        Result clip(const Eigen::Vector4f* v, Vertex* out, int& count) const
+        {
+            int all = ~0, any = 0;
+            for (int i = 0; i < 3; ++i)
+            {
+                int code = outcode(v[i]);
+                all &= code;
+                any |= code;
+            }
+            if (all & frustum_bits)
+                return Outside;
+            if (!(any & clip_bits))
+                return Inside;
+
+            Vertex buffer[2][max_vertices];
+            Vertex* in = buffer[0];
+            count = 3;
+            for (int i = 0; i < 3; ++i)
+                in[i] = {v[i], Eigen::Vector3f::Unit(i)};
+            for (int plane = 0; plane < num_planes; ++plane)
+            {
+                if (!(any & clip_bits & (1 << plane)))
+                    continue;
+                Vertex* result = in == buffer[0] ? buffer[1] : buffer[0];
+                int n = 0;
+                // Sutherland-Hodgman: keep the vertices inside, add one where an edge crosses the plane
+                for (int i = 0; i < count; ++i)
+                {
+                    const Vertex& a = in[i];
+                    const Vertex& b = in[(i + 1) % count];
+                    float da = distance(a.pos, plane), db = distance(b.pos, plane);
+                    if (da >= 0)
+                        result[n++] = a;
+                    if ((da >= 0) != (db >= 0))
+                    {
+                        float t = da / (da - db);
+                        result[n++] = {a.pos + t * (b.pos - a.pos), a.weights + t * (b.weights - a.weights)};
+                    }
+                }
+                in = result;
+                count = n;
+                if (count < 3)
+                    return Outside;
+            }
+            std::copy(in, in + count, out);
+            return Clipped;
+        }
+
+        // whether the clip space points v[0..count) all lie outside one plane of the frustum; then so
+        // does everything in their convex hull, a bounding box around a whole mesh for one
+        bool outside(const Eigen::Vector4f* v, int count) const
+        {
+            int all = ~0;
+            for (int i = 0; i < count; ++i)
+                all &= outcode(v[i]);
+            return all & frustum_bits;
+        }
+
+        // whether mode culls the screen space triangle a, b, c (x right, y up)
+        static bool culled(Cull mode, const Eigen::Vector2f& a, const Eigen::Vector2f& b, const Eigen::Vector2f& c)
+        {
+            if (mode == Cull::None)
+                return false;
+            float area2 = (b.x() - a.x()) * (c.y() - a.y()) - (c.x() - a.x()) * (b.y() - a.y());
+            return mode == Cull::Back ? area2 <= 0 : area2 >= 0;
+        }
+
+    private:
+        // planes 0-5 are the ones clip() cuts at (near and far, then the guard band),
+        // 6-9 the sides of the frustum, only used to reject
+        static constexpr int num_planes = 6;
+        static constexpr int clip_bits = (1 << num_planes) - 1;
+        static constexpr int frustum_bits = 0x3c3;
+
+        float w_sign;
+        float guard;
+
+        // >= 0 on the inside of the plane; p is turned around to make w positive in front of the camera
+        float distance(const Eigen::Vector4f& v, int plane) const
+        {
+            Eigen::Vector4f p = v * w_sign;
+            switch (plane)
+            {
+                case 0: return p.w() - p.z();
+                case 1: return p.w() + p.z();
+                case 2: return guard * p.w() - p.x();
+                case 3: return guard * p.w() + p.x();
+                case 4: return guard * p.w() - p.y();
+                case 5: return guard * p.w() + p.y();
+                case 6: return p.w() - p.x();
+                case 7: return p.w() + p.x();
+                case 8: return p.w() - p.y();
+                default: return p.w() + p.y();
+            }
+        }
+
+        int outcode(const Eigen::Vector4f& v) const
+        {
+            int code = 0;
+            for (int plane = 0; plane < 10; ++plane)
+                if (distance(v, plane) < 0)
+                    code |= 1 << plane;
+            return code;
+        }
+    };
+}
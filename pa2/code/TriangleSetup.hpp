@@ -0,0 +1,302 @@
+//
+// Per-triangle setup for the rasterizer
+//
+
+#pragma once
+
+#include <eigen3/Eigen/Eigen>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace rst
+{
+    // Everything the inner loop needs about one screen space triangle, worked out once before
+    // any pixel is visited:
+    //  * the three edge functions E(x, y) = A * x + B * y + C in fixed point with sub_bits
+    //    fractional bits. The vertices are snapped to that grid, so coverage is exact, and the
+    //    top-left rule gives a sample on an edge shared by two triangles to exactly one of them.
+    //  * plane equations of the barycentrics divided by w, so the perspective correct
+    //    barycentrics cost one division per pixel.
+    // Coverage is tested for a row of 8 pixels at once (one AVX2 compare per edge, a scalar loop
+    // without AVX2), and an 8x8 block the triangle misses is skipped after testing the edges
+    // at its corners, as is one the caller rejects (hierarchical z).
+    class TriangleSetup
+    {
+    public:
+        static constexpr int sub_bits = 4;
+        static constexpr int sub_one = 1 << sub_bits;
+        static constexpr int block_size = 8;
+        static constexpr int max_samples = 16;
+        // farther out the fixed point edge values could overflow; such triangles are not drawn
+        static constexpr float max_coord = 1 << 17;
+
+        // v: screen space vertices, x/y in pixels, w the view space depth.
+        // false if the triangle has no area or lies out of range, nothing to draw then.
+        bool setup(const Eigen::Vector4f* v)
+        {
+            int64_t X[3], Y[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                if (!(std::fabs(v[i].x()) < max_coord && std::fabs(v[i].y()) < max_coord))
+                    return false;
+                X[i] = std::lround(v[i].x() * sub_one);
+                Y[i] = std::lround(v[i].y() * sub_one);
+            }
+
+            // edge i is opposite vertex i, E_i(vertex i) is twice the signed area
+            for (int i = 0; i < 3; ++i)
+            {
+                int j = (i + 1) % 3, k = (i + 2) % 3;
+                edge_a[i] = Y[j] - Y[k];
+                edge_b[i] = X[k] - X[j];
+                edge_c[i] = X[j] * Y[k] - X[k] * Y[j];
+            }
+            int64_t area2 = edge_a[0] * X[0] + edge_b[0] * Y[0] + edge_c[0];
+            if (area2 == 0)
+                return false;
+            for (int i = 0; i < 3; ++i)
+            {
+                // either winding, inside is E >= 0
+                if (area2 < 0)
+                {
+                    edge_a[i] = -edge_a[i];
+                    edge_b[i] = -edge_b[i];
+                    edge_c[i] = -edge_c[i];
+                }
+                // samples exactly on an edge belong to the triangle for which the edge is top-left
+                bool top_left = edge_a[i] > 0 || (edge_a[i] == 0 && edge_b[i] > 0);
+                if (!top_left)
+                    edge_c[i] -= 1;
+            }
+
+            min_x = (int)(std::min(X[0], std::min(X[1], X[2])) >> sub_bits);
+            min_y = (int)(std::min(Y[0], std::min(Y[1], Y[2])) >> sub_bits);
+            max_x = (int)(std::max(X[0], std::max(X[1], X[2])) >> sub_bits) + 1;
+            max_y = (int)(std::max(Y[0], std::max(Y[1], Y[2])) >> sub_bits) + 1;
+
+            // barycentric i is 1 at vertex i, 0 on the opposite edge; the planes use the unsnapped
+            // vertices and are taken relative to vertex 0
+            origin_x = v[0].x();
+            origin_y = v[0].y();
+            float d = (v[1].x() - v[0].x()) * (v[2].y() - v[0].y()) - (v[2].x() - v[0].x()) * (v[1].y() - v[0].y());
+            if (d == 0)
+                return false;
+            for (int i = 0; i < 3; ++i)
+            {
+                int j = (i + 1) % 3, k = (i + 2) % 3;
+                float scale = 1.0f / (d * v[i].w());
+                plane[i][0] = i == 0 ? 1.0f / v[i].w() : 0.0f;
+                plane[i][1] = (v[j].y() - v[k].y()) * scale;
+                plane[i][2] = (v[k].x() - v[j].x()) * scale;
+            }
+            return true;
+        }
+
+        // the pixels min_x <= x < max_x, min_y <= y < max_y may be covered
+        int min_x, min_y, max_x, max_y;
+
+        // Walks the pixels x0 <= x < x1, y0 <= y < y1 in 8x8 blocks, lined up with (x0, y0). For every
+        // row of up to 8 pixels with a covered sample, span(x, y, cover) is called: bit i of cover[s]
+        // tells whether sample s of pixel (x + i, y) is inside. samples[s] is where sample s lies in
+        // the pixel, in 1/sub_one pixels ({sub_one / 2, sub_one / 2} is the center).
+        // block(bx, by) is asked first for every block the triangle may touch, the block (bx, by)
+        // to (bx + 7, by + 7) is skipped when it returns false.
+        template <typename Span, typename Block>
+        void walk(int x0, int y0, int x1, int y1, const int (*samples)[2], int num_samples, Span&& span, Block&& block) const
+        {
+            int start_x = std::max(x0, min_x);
+            int start_y = std::max(y0, min_y);
+            x1 = std::min(x1, max_x);
+            y1 = std::min(y1, max_y);
+            if (start_x >= x1 || start_y >= y1)
+                return;
+            num_samples = std::min(num_samples, max_samples);
+
+            const int64_t extent = block_size << sub_bits;
+            uint32_t cover[max_samples];
+            for (int by = y0 + (start_y - y0) / block_size * block_size; by < y1; by += block_size)
+            {
+                int first_row = std::max(0, start_y - by);
+                int rows = std::min(block_size, y1 - by);
+                for (int bx = x0 + (start_x - x0) / block_size * block_size; bx < x1; bx += block_size)
+                {
+                    uint32_t cols = ((1u << std::min(block_size, x1 - bx)) - 1) & ~((1u << std::max(0, start_x - bx)) - 1);
+                    int64_t px = (int64_t)bx << sub_bits, py = (int64_t)by << sub_bits;
+
+                    // every sample of the block lies in [px, px + extent] x [py, py + extent]
+                    int partial[3], num_partial = 0;
+                    bool outside = false;
+                    for (int e = 0; e < 3 && !outside; ++e)
+                    {
+                        int64_t corner = edge_a[e] * px + edge_b[e] * py + edge_c[e];
+                        int64_t lo = corner + std::min<int64_t>(edge_a[e], 0) * extent + std::min<int64_t>(edge_b[e], 0) * extent;
+                        int64_t hi = corner + std::max<int64_t>(edge_a[e], 0) * extent + std::max<int64_t>(edge_b[e], 0) * extent;
+                        outside = hi < 0;
+                        if (lo < 0)
+                            partial[num_partial++] = e;
+                    }
+                    if (outside || !block(bx, by))
+                        continue;
+
+                    if (num_partial == 0)
+                    {
+                        std::fill(cover, cover + num_samples, cols);
+                        for (int r = first_row; r < rows; ++r)
+                            span(bx, by + r, (const uint32_t*)cover);
+                        continue;
+                    }
+
+                    // an edge crossing the block is within (|A| + |B|) * extent of zero anywhere in
+                    // it, which fits in 32 bits for triangles inside max_coord
+                    row_t row[3][max_samples];
+                    int32_t step_y[3];
+                    for (int p = 0; p < num_partial; ++p)
+                    {
+                        int e = partial[p];
+                        step_y[p] = (int32_t)(edge_b[e] << sub_bits);
+                        for (int s = 0; s < num_samples; ++s)
+                        {
+                            int64_t value = edge_a[e] * (px + samples[s][0]) + edge_b[e] * (py + (int64_t)first_row * sub_one + samples[s][1]) + edge_c[e];
+                            row[p][s] = row_start((int32_t)value, (int32_t)(edge_a[e] << sub_bits));
+                        }
+                    }
+                    for (int r = first_row; r < rows; ++r)
+                    {
+                        uint32_t any = 0;
+                        for (int s = 0; s < num_samples; ++s)
+                        {
+                            uint32_t mask = cols;
+                            for (int p = 0; p < num_partial; ++p)
+                            {
+                                mask &= row_mask(row[p][s]);
+                                row[p][s] = row_next(row[p][s], step_y[p]);
+                            }
+                            cover[s] = mask;
+                            any |= mask;
+                        }
+                        if (any)
+                            span(bx, by + r, (const uint32_t*)cover);
+                    }
+                }
+            }
+        }
+
+        template <typename Span>
+        void walk(int x0, int y0, int x1, int y1, const int (*samples)[2], int num_samples, Span&& span) const
+        {
+            walk(x0, y0, x1, y1, samples, num_samples, span, [](int, int) { return true; });
+        }
+
+        // Perspective correct barycentrics at (x, y) in pixels; returns the interpolated w
+        float barycentric(float x, float y, float& alpha, float& beta, float& gamma) const
+        {
+            float dx = x - origin_x, dy = y - origin_y;
+            float p0 = plane[0][0] + plane[0][1] * dx + plane[0][2] * dy;
+            float p1 = plane[1][0] + plane[1][1] * dx + plane[1][2] * dy;
+            float p2 = plane[2][0] + plane[2][1] * dx + plane[2][2] * dy;
+            float w = 1.0f / (p0 + p1 + p2);
+            alpha = p0 * w;
+            beta = p1 * w;
+            gamma = p2 * w;
+            return w;
+        }
+
+        // barycentric() at the centers of the 8 pixels (x + i, y) of a span, i = 0..7; the plain
+        // loop is left to the compiler to vectorize
+        void barycentric_span(int x, int y, float* alpha, float* beta, float* gamma, float* w) const
+        {
+            float dx0 = x + 0.5f - origin_x, dy = y + 0.5f - origin_y;
+            float row[3];
+            for (int k = 0; k < 3; ++k)
+                row[k] = plane[k][0] + plane[k][2] * dy;
+            for (int i = 0; i < block_size; ++i)
+            {
+                float dx = dx0 + i;
+                float p0 = row[0] + plane[0][1] * dx;
+                float p1 = row[1] + plane[1][1] * dx;
+                float p2 = row[2] + plane[2][1] * dx;
+                float wi = 1.0f / (p0 + p1 + p2);
+                alpha[i] = p0 * wi;
+                beta[i] = p1 * wi;
+                gamma[i] = p2 * wi;
+                w[i] = wi;
+            }
+        }
+
+        // 1/w at (x, y) in pixels, and its change per pixel in x (ddx) and y (ddy). Unlike w, 1/w is
+        // linear on the screen.
+        float inv_w(float x, float y, float& ddx, float& ddy) const
+        {
+            ddx = plane[0][1] + plane[1][1] + plane[2][1];
+            ddy = plane[0][2] + plane[1][2] + plane[2][2];
+            return plane[0][0] + plane[1][0] + plane[2][0] + ddx * (x - origin_x) + ddy * (y - origin_y);
+        }
+
+        // How the perspective correct barycentrics change per pixel in x (ddx) and y (ddy), at a point
+        // where they are alpha, beta, gamma and w is what barycentric() returned there
+        void barycentric_gradient(float alpha, float beta, float gamma, float w, Eigen::Vector3f& ddx, Eigen::Vector3f& ddy) const
+        {
+            // b_i = p_i / sum(p), so d b_i = (d p_i - b_i * d sum(p)) * w
+            float sum_x = plane[0][1] + plane[1][1] + plane[2][1];
+            float sum_y = plane[0][2] + plane[1][2] + plane[2][2];
+            ddx = Eigen::Vector3f(plane[0][1] - alpha * sum_x, plane[1][1] - beta * sum_x, plane[2][1] - gamma * sum_x) * w;
+            ddy = Eigen::Vector3f(plane[0][2] - alpha * sum_y, plane[1][2] - beta * sum_y, plane[2][2] - gamma * sum_y) * w;
+        }
+
+    private:
+#if defined(__AVX2__)
+        // E at 8 neighbouring samples of a row
+        using row_t = __m256i;
+
+        static row_t row_start(int32_t value, int32_t step_x)
+        {
+            __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+            return _mm256_add_epi32(_mm256_set1_epi32(value), _mm256_mullo_epi32(_mm256_set1_epi32(step_x), lane));
+        }
+        static row_t row_next(row_t row, int32_t step_y)
+        {
+            return _mm256_add_epi32(row, _mm256_set1_epi32(step_y));
+        }
+        static uint32_t row_mask(row_t row)
+        {
+            __m256i inside = _mm256_cmpgt_epi32(row, _mm256_set1_epi32(-1));
+            return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(inside));
+        }
+#else
+        struct row_t
+        {
+            int32_t e[8];
+        };
+
+        static row_t row_start(int32_t value, int32_t step_x)
+        {
+            row_t row;
+            for (int i = 0; i < 8; ++i)
+                row.e[i] = value + i * step_x;
+            return row;
+        }
+        static row_t row_next(row_t row, int32_t step_y)
+        {
+            for (int i = 0; i < 8; ++i)
+                row.e[i] += step_y;
+            return row;
+        }
+        static uint32_t row_mask(const row_t& row)
+        {
+            uint32_t mask = 0;
+            for (int i = 0; i < 8; ++i)
+                mask |= (uint32_t)(row.e[i] >= 0) << i;
+            return mask;
+        }
+#endif
+
+        int64_t edge_a[3], edge_b[3], edge_c[3];
+        float origin_x, origin_y;
+        // barycentric i / w = plane[i][0] + plane[i][1] * (x - origin_x) + plane[i][2] * (y - origin_y)
+        float plane[3][3];
+    };
+}
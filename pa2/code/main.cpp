@@ -1,4 +1,7 @@
 // clang-format off
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include "rasterizer.hpp"
@@ -63,13 +66,67 @@ Eigen::Matrix4f get_projection_matrix(float eye_fov, float aspect_ratio, float z
     return projection;
 }
 
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Headless benchmark (Rasterizer bench [frames] [file.json]): the triangles turn once around in
+// frames frames, drawn with every MSAA sample count. Writes one JSON object with frames per second
+// and the average time per frame of clearing, drawing (vertex transform and rasterization),
+// resolving and turning the frame into an 8 bit image.
+void run_benchmark(rst::rasterizer& r, rst::pos_buf_id pos_id, rst::ind_buf_id ind_id, rst::col_buf_id col_id,
+                   int triangles, int frames, std::ostream& out)
+{
+    Eigen::Vector3f eye_pos = {0,0,5};
+    r.set_view(get_view_matrix(eye_pos));
+    r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
+
+    out << "{\n  \"width\": 700, \"height\": 700, \"frames\": " << frames << ",\n  \"runs\": [";
+    for (int samples : {1, 2, 4, 8})
+    {
+        r.set_msaa(samples);
+        double clear_ms = 0, draw_ms = 0, resolve_ms = 0, output_ms = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; ++frame)
+        {
+            auto stage = std::chrono::steady_clock::now();
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            clear_ms += elapsed_ms(stage);
+
+            stage = std::chrono::steady_clock::now();
+            r.set_model(get_model_matrix(360.0f * frame / frames));
+            r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+            draw_ms += elapsed_ms(stage);
+
+            stage = std::chrono::steady_clock::now();
+            r.resolve();
+            resolve_ms += elapsed_ms(stage);
+
+            stage = std::chrono::steady_clock::now();
+            cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
+            image.convertTo(image, CV_8UC3, 1.0f);
+            cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+            output_ms += elapsed_ms(stage);
+        }
+        double total_ms = elapsed_ms(start);
+
+        out << (samples == 1 ? "\n" : ",\n") << "    {\"msaa\": " << samples
+            << ", \"fps\": " << frames / (total_ms / 1000) << ", \"frame_ms\": " << total_ms / frames
+            << ", \"stage_ms\": {\"clear\": " << clear_ms / frames << ", \"draw\": " << draw_ms / frames
+            << ", \"resolve\": " << resolve_ms / frames << ", \"output\": " << output_ms / frames << "}"
+            << ", \"triangles_per_s\": " << triangles * frames / (total_ms / 1000) << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
 int main(int argc, const char** argv)
 {
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc == 2)
+    if (argc == 2 && std::string(argv[1]) != "bench")
     {
         command_line = true;
         filename = std::string(argv[1]);
@@ -110,6 +167,21 @@ int main(int argc, const char** argv)
     auto ind_id = r.load_indices(ind);
     auto col_id = r.load_colors(cols);
 
+    if (argc >= 2 && std::string(argv[1]) == "bench")
+    {
+        int frames = argc >= 3 ? std::max(1, std::atoi(argv[2])) : 200;
+        std::string path = argc >= 4 ? argv[3] : "benchmark.json";
+        std::ofstream file(path);
+        if (!file)
+        {
+            std::cerr << "cannot write " << path << "\n";
+            return 1;
+        }
+        run_benchmark(r, pos_id, ind_id, col_id, (int)ind.size(), frames, file);
+        std::cout << "benchmark results in " << path << "\n";
+        return 0;
+    }
+
     int key = 0;
     int frame_count = 0;
 
@@ -122,6 +194,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+        r.resolve();
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
         cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
@@ -140,6 +213,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
+        r.resolve();
 
         cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
         image.convertTo(image, CV_8UC3, 1.0f);
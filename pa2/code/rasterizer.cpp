@@ -8,28 +8,29 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <stdexcept>
 
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    pos_buf.push_back(positions);
+    int id = (int)pos_buf.size() - 1;
 
     return {id};
 }
 
 rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    ind_buf.push_back(indices);
+    int id = (int)ind_buf.size() - 1;
 
     return {id};
 }
 
 rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    col_buf.push_back(cols);
+    int id = (int)col_buf.size() - 1;
 
     return {id};
 }
@@ -39,90 +40,77 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-float getZfromCrossDot(Eigen::Vector2f p1,Eigen::Vector2f p2){
-    return (p1[0]*p2[1]) - (p1[1] * p2[0]);
-}
-
-static bool insideTriangle(float x, float y, const Vector4f* _v)
-{   
-    // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-    Eigen::Vector2f p;
-    p<<x,y;
-    Eigen::Vector2f AB = _v[1].head(2) - _v[0].head(2);
-    Eigen::Vector2f BC = _v[2].head(2) - _v[1].head(2);
-    Eigen::Vector2f CA = _v[0].head(2) - _v[2].head(2);
-
-    Eigen::Vector2f AP = p - _v[0].head(2);
-    Eigen::Vector2f BP = p - _v[1].head(2);
-    Eigen::Vector2f CP = p - _v[2].head(2);
-
-    if(getZfromCrossDot(AB,AP)>0 && getZfromCrossDot(BC,BP)>0 && getZfromCrossDot(CA,CP)>0) return true;
-    if(getZfromCrossDot(AB,AP)<0 && getZfromCrossDot(BC,BP)<0 && getZfromCrossDot(CA,CP)<0) return true;
-    return false;
-
-}
-
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v)
-{
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
-}
-
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-    auto& col = col_buf[col_buffer.col_id];
+    auto& buf = pos_buf.at(pos_buffer.pos_id);
+    auto& ind = ind_buf.at(ind_buffer.ind_id);
+    auto& col = col_buf.at(col_buffer.col_id);
 
     float f1 = (50 - 0.1) / 2.0; 
     float f2 = (50 + 0.1) / 2.0; 
 
     Eigen::Matrix4f mvp = projection * view * model;
+    // the guard band ends where the screen coordinates get too big for TriangleSetup
+    Clipper clipper(projection, TriangleSetup::max_coord / std::max(width, height));
     for (auto& i : ind)
     {
-        Triangle t;
-        Eigen::Vector4f v[] = {
+        Eigen::Vector4f clip[] = {
                 mvp * to_vec4(buf[i[0]], 1.0f),
                 mvp * to_vec4(buf[i[1]], 1.0f),
                 mvp * to_vec4(buf[i[2]], 1.0f)
         };
-        //Homogeneous division
-        for (auto& vec : v) {
-            float tempW=vec.w();
-            vec /= vec.w(); // 此处有误，vec.w/vec.w=1 ,损失了z深度值
-            vec.w()=tempW;  // 恢复一下w()的深度值，注意此处w()应该是负数
-        }
-        //Viewport transformation
-        for (auto & vert : v)
+        Clipper::Vertex polygon[Clipper::max_vertices];
+        int count = 3;
+        Clipper::Result result = clipper.clip(clip, polygon, count);
+        if (result == Clipper::Outside)
+            continue;
+        if (result == Clipper::Inside)
+            for (int k = 0; k < 3; ++k)
+                polygon[k] = {clip[k], Eigen::Vector3f::Unit(k)};
+
+        // 裁剪后是一个凸多边形，以第一个顶点为中心拆成三角形扇
+        for (int k = 1; k + 1 < count; ++k)
         {
-            //std::cout<<vert.x()<<" "<<vert.y()<<" "<<vert.z()<<std::endl;
-            std::cout<<vert.w()<<std::endl;
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;  //这里是，把-1~1 给拉伸成0.1~50这个范围 再加 -1~0这个对应0.1~50这个范围的距离
-                                            //意思是，把标准观察体移到标准视口坐标，把z深度拉伸成0.1~50这个范围的值
-            //std::cout<<vert.z()<<std::endl;
-            vert.z()=-vert.z(); //为了下面的深度计算，代表离摄像机的远近 ?此处存疑
-        }
+            const Clipper::Vertex* corner[] = {&polygon[0], &polygon[k], &polygon[k + 1]};
+            Triangle t;
+            Eigen::Vector4f v[] = {corner[0]->pos, corner[1]->pos, corner[2]->pos};
+            //Homogeneous division
+            for (auto& vec : v) {
+                float tempW=vec.w();
+                vec /= vec.w(); // 此处有误，vec.w/vec.w=1 ,损失了z深度值
+                vec.w()=tempW;  // 恢复一下w()的深度值，注意此处w()应该是负数
+            }
+            //Viewport transformation
+            for (auto & vert : v)
+            {
+                //std::cout<<vert.x()<<" "<<vert.y()<<" "<<vert.z()<<std::endl;
+                //std::cout<<vert.w()<<std::endl;
+                vert.x() = 0.5*width*(vert.x()+1.0);
+                vert.y() = 0.5*height*(vert.y()+1.0);
+                vert.z() = vert.z() * f1 + f2;  //这里是，把-1~1 给拉伸成0.1~50这个范围 再加 -1~0这个对应0.1~50这个范围的距离
+                                                //意思是，把标准观察体移到标准视口坐标，把z深度拉伸成0.1~50这个范围的值
+                //std::cout<<vert.z()<<std::endl;
+                vert.z()=-vert.z(); //为了下面的深度计算，代表离摄像机的远近 ?此处存疑
+            }
 
-        for (int i = 0; i < 3; ++i)
-        {
-            t.setVertex(i, v[i]);
-            t.setVertex(i, v[i]);
-            t.setVertex(i, v[i]);
-        }
+            if (Clipper::culled(cull, v[0].head<2>(), v[1].head<2>(), v[2].head<2>()))
+                continue;
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+            for (int j = 0; j < 3; ++j)
+            {
+                t.setVertex(j, v[j]);
+            }
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
+            // 颜色按裁剪得到的权重插值，没被裁剪的顶点权重就是 (1,0,0) 这样的单位向量
+            for (int j = 0; j < 3; ++j)
+            {
+                const Eigen::Vector3f& b = corner[j]->weights;
+                Eigen::Vector3f c = b[0] * col[i[0]] + b[1] * col[i[1]] + b[2] * col[i[2]];
+                t.setColor(j, c[0], c[1], c[2]);
+            }
 
-        rasterize_triangle(t);
+            rasterize_triangle(t);
+        }
     }
 }
 
@@ -132,71 +120,70 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     
     // TODO : Find out the bounding box of current triangle.
     // iterate through the pixel and find if the current pixel is inside the triangle
-    float min_x = std::min(v[0][0],std::min(v[1][0],v[2][0]));
-    float max_x = std::max(v[0][0],std::max(v[1][0],v[2][0]));
-    float min_y = std::min(v[0][1],std::min(v[1][1],v[2][1]));
-    float max_y = std::max(v[0][0],std::max(v[1][0],v[2][0]));
-
-    min_x=(int)std::floor(min_x);
-    max_x=(int)std::ceil(max_x);
-    min_y=(int)std::floor(min_y);
-    max_y=(int)std::ceil(max_y);
-
-    bool MSAA=true;
-    if(MSAA){ //MSAA2x
-        std::vector<Eigen::Vector2f> pos{
-            {0.25,0.25},
-            {0.75,0.25},
-            {0.25,0.75},
-            {0.75,0.75},
-        };
-        for(int x=min_x;x<=max_x;x++){
-            for(int y=min_y;y<=max_y;y++){
-                float minDepth=FLT_MAX-10;
-                int count=0;
-                for(int i=0;i<4;i++){
-                    if(insideTriangle((float)x+pos[i][0],(float)y+pos[i][1],t.v)){
-                    auto [alpha, beta, gamma] = computeBarycentric2D((float)x+pos[i][0], (float)y+pos[i][1], t.v);
-                    float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                    z_interpolated *= w_reciprocal; 
-                    minDepth=std::min(minDepth,abs(w_reciprocal));
-                    count++;
-                    }
-                }
-                if(count){
-                    if(depth_buf[get_index(x,y)]>minDepth){
-                        Eigen::Vector3f color= t.getColor() * count/4;
-                        Vector3f point;
-                        point<< (float)x,(float)y,minDepth;
-                        depth_buf[get_index(x,y)]=minDepth;
-                        set_pixel(point,color);
-                    }
+    TriangleSetup setup;
+    if(!setup.setup(t.v))
+        return;
+
+    // 深度用 -1/|w|：越小越近，而且和 1/w 一样在屏幕上是线性的，一个平面就能表示整个三角形的深度
+    float depth_dx, depth_dy;
+    float depth_0 = setup.inv_w(0, 0, depth_dx, depth_dy);
+    if (v[0].w() > 0)
+    {
+        depth_0 = -depth_0;
+        depth_dx = -depth_dx;
+        depth_dy = -depth_dy;
+    }
+
+    // the fragment shader: one color for the triangle (a shader with more to do would run once per
+    // pixel here, not once per sample)
+    Eigen::Vector3f color = t.getColor();
+    uint32_t all = (1u << samples) - 1;
+
+    setup.walk(0, 0, width, height, sample_pos, samples, [&](int x, int y, const uint32_t* cover) {
+        for(int i=0;i<TriangleSetup::block_size;i++){
+            uint32_t mask = 0;
+            for(int s=0;s<samples;s++)
+                mask |= (cover[s] >> i & 1) << s;
+            if(!mask)
+                continue;
+
+            pixel& p = pixels[get_index(x+i,y)];
+            float center = depth_0 + depth_dx * (x + i + 0.5f) + depth_dy * (y + 0.5f);
+            if(p.slot < 0)
+            {
+                // the samples of a compressed pixel all belong to one triangle, their depths are on its plane
+                uint32_t pass = 0;
+                for(int s=0;s<samples;s++)
+                    if((mask >> s & 1) && sample_depth_at(center, depth_dx, depth_dy, s) < sample_depth_at(p.depth, p.depth_dx, p.depth_dy, s))
+                        pass |= 1u << s;
+                if(!pass)
+                    continue;
+                if(pass == all)
+                {
+                    p = {color, center, depth_dx, depth_dy, -1};
+                    continue;
                 }
+                expand(p);
             }
-        }
-    }
-    else{
-        for(int x=min_x;x<=max_x;x++){
-            for(int y=min_y;y<=max_y;y++){
-                if(insideTriangle((float)x+0.5,(float)y+0.5,t.v)){
-                    auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-                    float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                    float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                    z_interpolated *= w_reciprocal; //这里的z深度取了绝对值，越小越靠近相机
-
-                    if(depth_buf[get_index(x,y)] > abs(w_reciprocal)){
-                        depth_buf[get_index(x,y)]=abs(w_reciprocal);
-                        Vector3f color=t.getColor();
-                        Vector3f point;
-                        point<< x,y,abs(w_reciprocal);
-                        set_pixel(point,color);
-
-                    }
+
+            uint32_t pass = 0;
+            for(int s=0;s<samples;s++){
+                int k = p.slot * samples + s;
+                float depth = sample_depth_at(center, depth_dx, depth_dy, s);
+                if((mask >> s & 1) && depth < sample_depth[k]){
+                    sample_depth[k] = depth;
+                    sample_color[k] = color;
+                    pass |= 1u << s;
                 }
             }
+            // the triangle won every sample: the pixel is compressed again
+            if(pass == all)
+            {
+                free_slots.push_back(p.slot);
+                p = {color, center, depth_dx, depth_dy, -1};
+            }
         }
-    }
+    });
     // If so, use the following code to get the interpolated z value.
     //auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
     //float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
@@ -206,6 +193,78 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t) {
     // TODO : set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
 }
 
+// Standard sample patterns (the ones of Direct3D), in 1/16 pixel from the pixel center, y down
+static const int pattern_1[1][2] = {{0, 0}};
+static const int pattern_2[2][2] = {{4, 4}, {-4, -4}};
+static const int pattern_4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const int pattern_8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+void rst::rasterizer::set_msaa(int sample_count)
+{
+    const int (*pattern)[2];
+    switch (sample_count)
+    {
+        case 1: pattern = pattern_1; break;
+        case 2: pattern = pattern_2; break;
+        case 4: pattern = pattern_4; break;
+        case 8: pattern = pattern_8; break;
+        default: throw std::runtime_error("MSAA takes 1, 2, 4 or 8 samples per pixel");
+    }
+    samples = sample_count;
+    for (int s = 0; s < samples; ++s)
+    {
+        // TriangleSetup counts in 1/sub_one pixel from the pixel corner, y up
+        sample_pos[s][0] = TriangleSetup::sub_one / 2 + pattern[s][0] * TriangleSetup::sub_one / 16;
+        sample_pos[s][1] = TriangleSetup::sub_one / 2 - pattern[s][1] * TriangleSetup::sub_one / 16;
+        sample_dx[s] = pattern[s][0] / 16.0f;
+        sample_dy[s] = -pattern[s][1] / 16.0f;
+    }
+    clear(Buffers::Color | Buffers::Depth);
+}
+
+// the samples of a compressed pixel get their own storage, all equal to the pixel
+void rst::rasterizer::expand(pixel& p)
+{
+    if (free_slots.empty())
+    {
+        p.slot = (int)(sample_color.size() / samples);
+        sample_color.resize(sample_color.size() + samples);
+        sample_depth.resize(sample_depth.size() + samples);
+    }
+    else
+    {
+        p.slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    for (int s = 0; s < samples; ++s)
+    {
+        sample_color[p.slot * samples + s] = p.color;
+        sample_depth[p.slot * samples + s] = sample_depth_at(p.depth, p.depth_dx, p.depth_dy, s);
+    }
+}
+
+void rst::rasterizer::resolve()
+{
+    for (int index = 0; index < width * height; ++index)
+    {
+        const pixel& p = pixels[index];
+        if (p.slot < 0)
+        {
+            frame_buf[index] = p.color;
+            continue;
+        }
+        Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+        for (int s = 0; s < samples; ++s)
+            sum += sample_color[p.slot * samples + s];
+        frame_buf[index] = sum / samples;
+    }
+}
+
+void rst::rasterizer::set_cull(Cull mode)
+{
+    cull = mode;
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -223,20 +282,42 @@ void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 
 void rst::rasterizer::clear(rst::Buffers buff)
 {
-    if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
+    bool color = (buff & rst::Buffers::Color) == rst::Buffers::Color;
+    bool depth = (buff & rst::Buffers::Depth) == rst::Buffers::Depth;
+    if (color && depth)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        // every pixel compressed again
+        std::fill(pixels.begin(), pixels.end(), pixel{{0, 0, 0}, std::numeric_limits<float>::infinity(), 0, 0, -1});
+        sample_color.clear();
+        sample_depth.clear();
+        free_slots.clear();
+    }
+    else if (color)
+    {
+        for (auto& p : pixels)
+            p.color = {0, 0, 0};
+        std::fill(sample_color.begin(), sample_color.end(), Eigen::Vector3f{0, 0, 0});
+    }
+    else if (depth)
+    {
+        for (auto& p : pixels)
+        {
+            p.depth = std::numeric_limits<float>::infinity();
+            p.depth_dx = p.depth_dy = 0;
+        }
+        std::fill(sample_depth.begin(), sample_depth.end(), std::numeric_limits<float>::infinity());
     }
-    if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
+    if (color)
     {
-        std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
     }
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    pixels.resize(w * h);
+    set_msaa(4);
 }
 
 int rst::rasterizer::get_index(int x, int y)
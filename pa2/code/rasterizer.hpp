@@ -8,6 +8,8 @@
 #include <algorithm>
 #include "global.hpp"
 #include "Triangle.hpp"
+#include "TriangleSetup.hpp"
+#include "Clipper.hpp"
 using namespace Eigen;
 
 namespace rst
@@ -65,11 +67,20 @@ namespace rst
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
+        // back face culling is off until this says otherwise
+        void set_cull(Cull mode);
 
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
         void clear(Buffers buff);
 
+        // Multisampling with 1, 2, 4 (the default) or 8 samples per pixel in the standard patterns;
+        // clears the buffers. Every sample has its own depth and color, the color of a pixel is
+        // only known after resolve().
+        void set_msaa(int sample_count);
+        // averages the samples of every pixel into the frame buffer
+        void resolve();
+
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
@@ -86,18 +97,44 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
+        Cull cull = Cull::None;
+
+        // a flat array of buffers per kind, a buffer id is the slot of its buffer
+        std::vector<std::vector<Eigen::Vector3f>> pos_buf;
+        std::vector<std::vector<Eigen::Vector3i>> ind_buf;
+        std::vector<std::vector<Eigen::Vector3f>> col_buf;
 
         std::vector<Eigen::Vector3f> frame_buf;
 
-        std::vector<float> depth_buf;
+        // Multisample buffers, compressed: while one triangle covers all samples of a pixel they
+        // share the pixel's color, and their depths lie on the plane depth + depth_dx * dx +
+        // depth_dy * dy (dx, dy from the pixel center). Only a pixel with samples of different
+        // triangles, along their edges, takes a slot: samples slot * samples .. + samples - 1 of
+        // sample_color / sample_depth. So memory grows with the number of edge pixels, not with
+        // width * height * samples.
+        struct pixel
+        {
+            Eigen::Vector3f color;
+            float depth, depth_dx, depth_dy;
+            int slot;   // -1 while compressed
+        };
+        std::vector<pixel> pixels;
+        std::vector<Eigen::Vector3f> sample_color;
+        std::vector<float> sample_depth;
+        std::vector<int> free_slots;
+
+        int samples = 1;
+        // where the samples are, for TriangleSetup (1/sub_one pixel from the corner) and in pixels from the center
+        int sample_pos[8][2];
+        float sample_dx[8], sample_dy[8];
+
+        float sample_depth_at(float depth, float depth_dx, float depth_dy, int s) const
+        {
+            return depth + depth_dx * sample_dx[s] + depth_dy * sample_dy[s];
+        }
+        void expand(pixel& p);
         int get_index(int x, int y);
 
         int width, height;
-
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
     };
 }